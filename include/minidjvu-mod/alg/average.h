@@ -7,6 +7,7 @@
  * The result is to be destroyed with mdjvu_bitmap_destroy().
  * 
  * Additionally, centers must be given.
+ * It keeps no shared state, so different classes may be averaged in parallel.
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_average(mdjvu_bitmap_t *bitmaps,
                                             int32 n,
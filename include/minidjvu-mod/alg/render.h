@@ -3,3 +3,21 @@
  */
 
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_render(mdjvu_image_t);
+
+/* Render the rectangle x..x+w-1, y..y+h-1 of the image reduced `scale' times
+ * (scale is 1, 2, 4 or 8). The result is a graymap of
+ * (w + scale - 1) / scale by (h + scale - 1) / scale pixels,
+ * each holding the share of black pixels in its square, from 0 (white)
+ * to 255 (black). Parts of the rectangle outside the page are white.
+ * Release the result with mdjvu_destroy_2d_array().
+ * Returns NULL if the rectangle is empty or the scale is not supported.
+ */
+MDJVU_FUNCTION unsigned char **mdjvu_render_region(mdjvu_image_t,
+    int32 x, int32 y, int32 w, int32 h, int scale);
+
+/* Same as mdjvu_render_region(), but the graymap pixels
+ * that are at least `threshold' (1..255) become black in a bitmap.
+ * With scale 1, this is a crop of mdjvu_render().
+ */
+MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_render_region_bitmap(mdjvu_image_t,
+    int32 x, int32 y, int32 w, int32 h, int scale, int threshold);
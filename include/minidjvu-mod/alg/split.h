@@ -15,3 +15,26 @@ MDJVU_FUNCTION void mdjvu_split_options_destroy(mdjvu_split_options_t);
 
 MDJVU_FUNCTION mdjvu_image_t
     mdjvu_split(mdjvu_bitmap_t, int32 dpi, mdjvu_split_options_t);
+
+/*
+ * Same as mdjvu_split(), but the bitmap comes row by row, so only
+ * a window of rows is kept in memory instead of the whole page.
+ * read_row() is called for rows 0..height-1 in order; it should store
+ * the packed y-th row into `row' and return nonzero.
+ * If it returns 0, splitting stops and NULL is returned.
+ */
+MDJVU_FUNCTION mdjvu_image_t
+    mdjvu_split_rows(int32 width, int32 height, int32 dpi,
+                     mdjvu_split_options_t,
+                     int (*read_row)(void *param, unsigned char *row, int32 y),
+                     void *param);
+
+/*
+ * Turns a decoded JB2 page into what mdjvu_split() would make of its
+ * rendering, without rendering it. Blits of shapes marked by the JB2 loader
+ * as non-symbol data are split; other blits are taken as they are.
+ * The result owns copies of all its bitmaps, including those
+ * from the shared dictionary, so the source may be destroyed right away.
+ */
+MDJVU_FUNCTION mdjvu_image_t
+    mdjvu_split_image(mdjvu_image_t, int32 dpi, mdjvu_split_options_t);
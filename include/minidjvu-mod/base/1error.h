@@ -18,6 +18,8 @@ typedef enum
     mdjvu_error_corrupted_tiff,
     mdjvu_error_wrong_djvu_type,
     mdjvu_error_djvu_no_Sjbz,
+    mdjvu_error_djvu_no_dictionary,
+    mdjvu_error_djvu_no_page,
     mdjvu_error_recursive_prototypes,
     mdjvu_error_tiff_support_disabled,
     mdjvu_error_png_support_disabled
@@ -11,6 +11,8 @@
  * Also added some integer read/write functions.
  */
 
+#include <stddef.h> /* size_t */
+
 
 /* Structure MinidjvuFile is never defined.
  * Inside the minidjvu-mod library, mdjvu_file_t is FILE *.
@@ -35,3 +37,40 @@ MDJVU_FUNCTION void mdjvu_write_big_endian_int16(int16, mdjvu_file_t);
 MDJVU_FUNCTION void mdjvu_write_little_endian_int16(int16, mdjvu_file_t);
 MDJVU_FUNCTION int16 mdjvu_read_big_endian_int16(mdjvu_file_t);
 MDJVU_FUNCTION int16 mdjvu_read_little_endian_int16(mdjvu_file_t);
+
+
+/* Memory files.
+ * A memory file is a writable and seekable mdjvu_file_t which collects
+ * everything written into a heap buffer. It lets the mdjvu_file_save_*()
+ * functions produce their output without touching the filesystem.
+ *
+ * mdjvu_memory_file_create() returns NULL on failure.
+ * mdjvu_memory_file_close() closes the file and hands over the buffer
+ * (free() it) and its length; returns NULL if anything went wrong.
+ * The file cursor must be at the end of data when closing.
+ *
+ * mdjvu_memory_file_finish() is for savers writing into a memory file:
+ * given the memory file (may be NULL if creating it failed) and what
+ * the saver returned, it closes the file and hands over the buffer
+ * on success, or frees it and sets *perr (unless the saver did) on failure.
+ * Returns 1 on success, 0 on failure (then *pbuffer is NULL).
+ */
+typedef struct MinidjvuMemoryFile *mdjvu_memory_file_t;
+
+MDJVU_FUNCTION mdjvu_memory_file_t mdjvu_memory_file_create(void);
+MDJVU_FUNCTION mdjvu_file_t mdjvu_memory_file_get_file(mdjvu_memory_file_t);
+MDJVU_FUNCTION void *mdjvu_memory_file_close(mdjvu_memory_file_t, int32 *plength);
+MDJVU_FUNCTION int mdjvu_memory_file_finish(mdjvu_memory_file_t, int result,
+                                            void **pbuffer, int32 *plength, mdjvu_error_t *perr);
+
+/* Mapped files.
+ * mdjvu_map_file() makes the whole file readable in memory:
+ * it's mmap()ed where possible and read into a heap buffer otherwise.
+ * Returns NULL if the file could not be opened or read.
+ */
+typedef struct MinidjvuMappedFile *mdjvu_mapped_file_t;
+
+MDJVU_FUNCTION mdjvu_mapped_file_t mdjvu_map_file(const char *path);
+MDJVU_FUNCTION const void *mdjvu_mapped_file_get_data(mdjvu_mapped_file_t);
+MDJVU_FUNCTION size_t mdjvu_mapped_file_get_size(mdjvu_mapped_file_t);
+MDJVU_FUNCTION void mdjvu_unmap_file(mdjvu_mapped_file_t);
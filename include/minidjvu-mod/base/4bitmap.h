@@ -79,6 +79,12 @@ MDJVU_FUNCTION void mdjvu_bitmap_unpack_all_0_or_1
 MDJVU_FUNCTION void mdjvu_bitmap_assign(mdjvu_bitmap_t d, mdjvu_bitmap_t src);
 MDJVU_FUNCTION void mdjvu_bitmap_exchange(mdjvu_bitmap_t d, mdjvu_bitmap_t src);
 MDJVU_FUNCTION void mdjvu_bitmap_clear(mdjvu_bitmap_t);
+/* Swap black and white. The unused bits at the end of each row stay 0. */
+MDJVU_FUNCTION void mdjvu_bitmap_invert(mdjvu_bitmap_t);
+/* Zero the unused bits at the end of each packed row
+ * (for rows filled by raw copying).
+ */
+MDJVU_FUNCTION void mdjvu_bitmap_clear_padding(mdjvu_bitmap_t);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_bitmap_crop
     (mdjvu_bitmap_t b, int32 left, int32 top, int32 w, int32 h);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_bitmap_clone(mdjvu_bitmap_t b);
@@ -16,6 +16,41 @@ MDJVU_FUNCTION int mdjvu_locate_jb2_chunk(mdjvu_file_t file, int32 *plength, mdj
 MDJVU_FUNCTION mdjvu_image_t mdjvu_file_load_djvu_page(mdjvu_file_t file, mdjvu_error_t *);
 MDJVU_FUNCTION mdjvu_image_t mdjvu_load_djvu_page(const char *path, mdjvu_error_t *);
 
+/*
+ * The same, parsing a DjVu file that is already in memory.
+ * The JB2 data are decoded in place, nothing is copied.
+ * The leading "AT&T" magic is optional here.
+ * mdjvu_load_djvu_page() maps the file and calls this.
+ */
+MDJVU_FUNCTION int mdjvu_memory_locate_jb2_chunk(const void *buffer, size_t size,
+                                                 const void **pchunk, int32 *plength, mdjvu_error_t *);
+MDJVU_FUNCTION mdjvu_image_t mdjvu_memory_load_djvu_page(const void *buffer, size_t size, mdjvu_error_t *);
+
+/*
+ * Multipage documents (bundled FORM:DJVM) with random access to pages.
+ * Opening a document only indexes the components; a page is decoded
+ * when it's asked for, along with the shared dictionary it includes.
+ * Dictionaries are decoded once and shared by all the pages that use them:
+ * a loaded page holds a reference to its dictionary until it's given back
+ * with mdjvu_document_unload_page(). Besides the referenced ones,
+ * the document keeps up to `limit' (4 by default) recently used dictionaries.
+ * Pages may be loaded and unloaded from several threads at once.
+ * A single-page FORM:DJVU file opens as a document of one page.
+ * The buffer given to mdjvu_memory_open_djvu_document() is not copied.
+ */
+typedef struct MinidjvuDocument *mdjvu_document_t;
+
+MDJVU_FUNCTION mdjvu_document_t mdjvu_open_djvu_document(const char *path, mdjvu_error_t *);
+MDJVU_FUNCTION mdjvu_document_t mdjvu_memory_open_djvu_document(const void *buffer, size_t size,
+                                                                mdjvu_error_t *);
+MDJVU_FUNCTION int32 mdjvu_document_get_page_count(mdjvu_document_t);
+MDJVU_FUNCTION void mdjvu_document_set_dictionary_limit(mdjvu_document_t, int32 limit);
+/* page numbers start with 0 */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_document_load_page(mdjvu_document_t, int32 page, mdjvu_error_t *);
+/* destroys the page */
+MDJVU_FUNCTION void mdjvu_document_unload_page(mdjvu_document_t, mdjvu_image_t page);
+MDJVU_FUNCTION void mdjvu_close_djvu_document(mdjvu_document_t);
+
 /*
  * 1 - success, 0 - failure
  * After mdjvu_file_save_djvu_page() the file cursor is before the JB2 chunk.
@@ -34,9 +69,53 @@ MDJVU_FUNCTION int mdjvu_file_save_djvu_dictionary(mdjvu_image_t, mdjvu_file_t,
                                              int indirect, mdjvu_error_t *, int erosion);
 MDJVU_FUNCTION int mdjvu_save_djvu_dictionary(mdjvu_image_t image, const char *path, mdjvu_error_t *, int erosion);
 
+/*
+ * Memory targets: the page (dictionary) is encoded into a malloc()ed buffer
+ * returned in *pbuffer (free() it), its length goes to *plength.
+ * IFF chunk lengths are patched in memory, the bytes are the same
+ * as mdjvu_file_save_djvu_page() would write at an even file offset.
+ * 1 - success, 0 - failure (then *pbuffer is NULL).
+ */
+MDJVU_FUNCTION int mdjvu_memory_save_djvu_page(mdjvu_image_t, const char *dict_name, int indirect,
+                                               void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion);
+MDJVU_FUNCTION int mdjvu_memory_save_djvu_dictionary(mdjvu_image_t, int indirect,
+                                               void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion);
+
+/*
+ * Streaming writer of bundled multipage documents.
+ * Components are appended in the order of `elements' as soon as they're
+ * encoded, so nothing has to be kept in memory or in temporary files.
+ * Space for the directory is reserved on creation and filled in on closing.
+ * `elements' must stay valid until then.
+ * The file must be opened for update ("w+b"): in the unlikely case
+ * the reserved space is too small, the components are moved.
+ */
+typedef struct MinidjvuBundleWriter *mdjvu_bundle_writer_t;
+
+MDJVU_FUNCTION mdjvu_bundle_writer_t mdjvu_bundle_writer_create(char **elements, int n, mdjvu_file_t file);
+MDJVU_FUNCTION int mdjvu_bundle_writer_append(mdjvu_bundle_writer_t, const void *data, int32 size,
+                                              mdjvu_error_t *perr);
+/* Writes the directory and destroys the writer; 1 - success, 0 - failure. */
+MDJVU_FUNCTION int mdjvu_bundle_writer_close(mdjvu_bundle_writer_t, mdjvu_error_t *perr);
+
 MDJVU_FUNCTION void mdjvu_write_dirm_bundled(char **elements, int *sizes, int n, mdjvu_file_t f, mdjvu_error_t *perr);
+/* Same as mdjvu_write_dirm_bundled(), but components are already placed
+ * at the given (absolute) offsets.
+ */
+MDJVU_FUNCTION void mdjvu_write_dirm_bundled_with_offsets(char **elements, int *sizes, int *offsets,
+                                                          int n, mdjvu_file_t f, mdjvu_error_t *perr);
 MDJVU_FUNCTION void mdjvu_write_dirm_indirect(char **elements, int *sizes, int n, mdjvu_file_t f, mdjvu_error_t *perr);
 
+/*
+ * Reads the contents of a bundled DIRM chunk: for each of *pn components,
+ * its absolute offset, flags (the low 6 bits are 1 for pages, 0 for shared files)
+ * and ID. The arrays are allocated; free them with mdjvu_free_dirm().
+ */
+MDJVU_FUNCTION int mdjvu_memory_read_dirm_bundled(const void *chunk, int32 length, int32 *pn,
+                                                  int32 **poffsets, unsigned char **pflags, char ***pids,
+                                                  mdjvu_error_t *perr);
+MDJVU_FUNCTION void mdjvu_free_dirm(int32 *offsets, unsigned char *flags, char **ids, int32 n);
+
 /* Writes DjVu INFO chunk, as described in DjVu 2 Spec., 6.4.2, page 7.
  * Gamma and version numbers are always default.
  * This function does not write the chunk header.
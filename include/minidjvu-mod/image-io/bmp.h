@@ -13,3 +13,5 @@ MDJVU_FUNCTION int mdjvu_file_save_bmp(mdjvu_bitmap_t, mdjvu_file_t, int32 resol
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_load_bmp(const char *path, mdjvu_error_t *);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t, mdjvu_error_t *);
+/* Parses a BMP file that is already in memory (mdjvu_load_bmp() maps it). */
+MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_memory_load_bmp(const void *data, size_t size, mdjvu_error_t *);
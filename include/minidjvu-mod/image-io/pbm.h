@@ -13,3 +13,24 @@ MDJVU_FUNCTION int mdjvu_file_save_pbm(mdjvu_bitmap_t, mdjvu_file_t, mdjvu_error
  */
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *);
 MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t, mdjvu_error_t *);
+/* Parses a PBM file that is already in memory (mdjvu_load_pbm() maps it). */
+MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_memory_load_pbm(const void *data, size_t size, mdjvu_error_t *);
+
+/*
+ * Reading a PBM file row by row, for mdjvu_split_rows().
+ * Rows are read in order from the top; read_row() returns 1 - success,
+ * 0 - failure.
+ */
+typedef struct MinidjvuPbmReader *mdjvu_pbm_reader_t;
+
+MDJVU_FUNCTION mdjvu_pbm_reader_t mdjvu_pbm_reader_open(const char *path, mdjvu_error_t *);
+MDJVU_FUNCTION int32 mdjvu_pbm_reader_get_width(mdjvu_pbm_reader_t);
+MDJVU_FUNCTION int32 mdjvu_pbm_reader_get_height(mdjvu_pbm_reader_t);
+MDJVU_FUNCTION int mdjvu_pbm_reader_read_row(mdjvu_pbm_reader_t, unsigned char *packed_row, mdjvu_error_t *);
+/*
+ * Instead of reading rows, the whole page may be loaded at once
+ * through a mapping of the file, as mdjvu_load_pbm() does.
+ * The header isn't parsed again. NULL if failed.
+ */
+MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_pbm_reader_load(mdjvu_pbm_reader_t, mdjvu_error_t *);
+MDJVU_FUNCTION void mdjvu_pbm_reader_close(mdjvu_pbm_reader_t);
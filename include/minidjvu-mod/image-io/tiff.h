@@ -7,6 +7,13 @@
 
 MDJVU_FUNCTION int mdjvu_save_tiff(mdjvu_bitmap_t, const char *path, mdjvu_error_t *);
 
+/* Multipage TIFF: each appended bitmap becomes the next page. */
+typedef struct MinidjvuTiffWriter *mdjvu_tiff_writer_t;
+
+MDJVU_FUNCTION mdjvu_tiff_writer_t mdjvu_tiff_writer_create(const char *path, mdjvu_error_t *);
+MDJVU_FUNCTION int mdjvu_tiff_writer_append(mdjvu_tiff_writer_t, mdjvu_bitmap_t, mdjvu_error_t *);
+MDJVU_FUNCTION void mdjvu_tiff_writer_close(mdjvu_tiff_writer_t);
+
 
 /* If the TIFF file has no resolution information,
  * then `resolution' will be unchanged.
@@ -19,3 +26,25 @@ MDJVU_FUNCTION int mdjvu_have_tiff_support(void);
 MDJVU_FUNCTION void mdjvu_disable_tiff_warnings(void);
 
 MDJVU_FUNCTION uint32 mdjvu_get_tiff_page_count(const char *path);
+
+/*
+ * Multipage TIFF: reads pages one after another from `first_page' on,
+ * keeping the file open (mdjvu_load_tiff() seeks from the start each time).
+ * A reader must be used by one thread at a time; open several to read
+ * different parts of the file in parallel.
+ */
+typedef struct MinidjvuTiffReader *mdjvu_tiff_reader_t;
+
+MDJVU_FUNCTION mdjvu_tiff_reader_t mdjvu_tiff_reader_open(const char *path, uint32 first_page, mdjvu_error_t *);
+/* `resolution' works as in mdjvu_load_tiff() */
+MDJVU_FUNCTION mdjvu_bitmap_t mdjvu_tiff_reader_next(mdjvu_tiff_reader_t, int32 *resolution, mdjvu_error_t *);
+MDJVU_FUNCTION void mdjvu_tiff_reader_close(mdjvu_tiff_reader_t);
+
+/*
+ * Instead of mdjvu_tiff_reader_next(), the next page may be read row by row
+ * (for mdjvu_split_rows()): mdjvu_tiff_reader_next_rows() gets its size,
+ * then mdjvu_tiff_reader_read_row() gives packed rows in order from the top.
+ * Both return 1 - success, 0 - failure.
+ */
+MDJVU_FUNCTION int mdjvu_tiff_reader_next_rows(mdjvu_tiff_reader_t, int32 *width, int32 *height, int32 *resolution, mdjvu_error_t *);
+MDJVU_FUNCTION int mdjvu_tiff_reader_read_row(mdjvu_tiff_reader_t, unsigned char *packed_row, mdjvu_error_t *);
@@ -6,8 +6,21 @@
 /*
  * These functions return NULL if failed to read JB2.
  * Loading jb2 by path is not supported.
+ * Shapes coded as non-symbol data get the suspiciously big flag.
  */
 MDJVU_FUNCTION mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t, int32 length, mdjvu_error_t *);
+/* Decodes `length' bytes of JB2 stream right from memory. */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_memory_load_jb2(const void *data, int32 length, mdjvu_error_t *);
+/*
+ * Decode a page that refers to a shared dictionary (see mdjvu_image_set_dictionary()).
+ * The dictionary must outlive the page; its shapes are blitted, not copied,
+ * and it's only read, so pages may be decoded with one dictionary in parallel.
+ * Without a dictionary such pages fail with mdjvu_error_djvu_no_dictionary.
+ */
+MDJVU_FUNCTION mdjvu_image_t mdjvu_file_load_jb2_with_dictionary(mdjvu_file_t, int32 length,
+                                                                 mdjvu_image_t dict, mdjvu_error_t *);
+MDJVU_FUNCTION mdjvu_image_t mdjvu_memory_load_jb2_with_dictionary(const void *data, int32 length,
+                                                                   mdjvu_image_t dict, mdjvu_error_t *);
 
 /*
  * 1 - success, 0 - error
@@ -20,6 +33,13 @@ MDJVU_FUNCTION int mdjvu_file_save_jb2(mdjvu_image_t, mdjvu_file_t, mdjvu_error_
 MDJVU_FUNCTION int mdjvu_save_jb2_dictionary(mdjvu_image_t, const char *path, mdjvu_error_t *, int erosion);
 MDJVU_FUNCTION int mdjvu_file_save_jb2_dictionary(mdjvu_image_t, mdjvu_file_t, mdjvu_error_t *, int erosion);
 
+/*
+ * Same, but the JB2 stream goes to a malloc()ed buffer (*pbuffer, free() it)
+ * of *plength bytes. On failure *pbuffer is NULL.
+ */
+MDJVU_FUNCTION int mdjvu_memory_save_jb2(mdjvu_image_t, void **pbuffer, int32 *plength, mdjvu_error_t *, int erosion);
+MDJVU_FUNCTION int mdjvu_memory_save_jb2_dictionary(mdjvu_image_t, void **pbuffer, int32 *plength, mdjvu_error_t *, int erosion);
+
 
 /*
  * This is called automatically by xxx_save_jb2() functions.
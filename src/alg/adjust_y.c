@@ -6,6 +6,7 @@
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <stdlib.h>
 #include <assert.h>
+#include "bitwords.h"
 
 
 #define DO_NOT_ADJUST -10000
@@ -19,6 +20,54 @@
  */
 
 
+static int count_trailing_zeros(uint32 x) /* x must not be 0 */
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    if (!(x & 0x0000FFFF)) { n += 16; x >>= 16; }
+    if (!(x & 0x000000FF)) { n +=  8; x >>=  8; }
+    if (!(x & 0x0000000F)) { n +=  4; x >>=  4; }
+    if (!(x & 0x00000003)) { n +=  2; x >>=  2; }
+    if (!(x & 0x00000001)) n++;
+    return n;
+#endif
+}
+
+/* get_word() with the pixels past the width w cleared */
+static uint32 get_masked_word(const unsigned char *row, int32 i, int32 w)
+{
+    uint32 word = get_word(row, i, (w + 7) >> 3);
+    if (w - 8 * i < 32)
+        word &= ~(uint32) 0 << (32 - (w - 8 * i));
+    return word;
+}
+
+/* Returns the distance from the first black pixel in a packed row
+ * to the last one, inclusive, or 0 if the row is white.
+ */
+static int32 get_row_extent(const unsigned char *row, int32 w)
+{
+    int32 row_size = (w + 7) >> 3;
+    int32 i, first;
+    uint32 word = 0;
+
+    for (i = 0; i < row_size; i += 4)
+    {
+        if ((word = get_masked_word(row, i, w)) != 0)
+            break;
+    }
+    if (!word) return 0;
+    first = 8 * i + count_leading_zeros(word);
+
+    for (i = (row_size - 1) & ~3; ; i -= 4)
+    {
+        if ((word = get_masked_word(row, i, w)) != 0)
+            return 8 * i + 31 - count_trailing_zeros(word) - first + 1;
+    }
+}
+
 /* Estimate position of baseline.
  * The baseline position is measured in quarter pixels.
  * Using fractional pixels makes a big improvement.
@@ -28,22 +77,11 @@ static int32 compute_baseline(mdjvu_bitmap_t bitmap)
     int32 w = mdjvu_bitmap_get_width(bitmap);
     int32 h = mdjvu_bitmap_get_height(bitmap);
     int32 *mass = (int32 *) malloc(h * sizeof(int32));
-    unsigned char *row = (unsigned char *) malloc(w);
-    int32 i, j, m;
+    int32 i, m;
     int32 tm = 0;
     for (i = 0; i < h; i++)
     {
-        mdjvu_bitmap_unpack_row(bitmap, row, i);
-        for (j = 0; j < w; j++)
-        {
-            if (row[j])
-                break;
-        }
-        for (m = w - j; m > 0; m--)
-        {
-            if (row[j + m - 1])
-                break;
-        }
+        m = get_row_extent(mdjvu_bitmap_access_packed_row(bitmap, i), w);
         mass[h - i - 1] = m;
         tm += m;
     }
@@ -57,7 +95,6 @@ static int32 compute_baseline(mdjvu_bitmap_t bitmap)
         i += 1;
     }
 
-    free(row);
     free(mass);
 
     return 4 * (h - 1) - i;
@@ -8,15 +8,115 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <string.h>
+
+/* The counts of black pixels are kept bit-sliced: bit j of all counters
+ * in a row makes a packed row of plane j. Adding a bitmap row is then
+ * a ripple-carry addition of whole words, and since each bit position
+ * is counted on its own, byte order inside words doesn't matter.
+ */
+
+#define WORD_BYTES ((int32) sizeof(size_t))
+
+typedef struct
+{
+    int32 plane_count;
+    int32 stride;               /* words in a row of a plane */
+    size_t **planes;            /* planes[j] has all the rows */
+} Counter;
+
+static void counter_init(Counter *c, int32 w, int32 h, int32 n)
+{
+    int32 j;
+    c->plane_count = 1;
+    while (c->plane_count < 31 && ((int32) 1 << c->plane_count) <= n)
+        c->plane_count++;
+    c->stride = (((w + 7) >> 3) + WORD_BYTES - 1) / WORD_BYTES;
+    c->planes = (size_t **) malloc(c->plane_count * sizeof(size_t *));
+    for (j = 0; j < c->plane_count; j++)
+        c->planes[j] = (size_t *) calloc(c->stride * h, sizeof(size_t));
+}
+
+static void counter_free(Counter *c)
+{
+    int32 j;
+    for (j = 0; j < c->plane_count; j++)
+        free(c->planes[j]);
+    free(c->planes);
+}
+
+/* Adds 1 to counters of row y where `bits' (a row of words) has ones,
+ * looking at words from..to only.
+ */
+static void counter_add(Counter *c, int32 y, const size_t *bits,
+                        int32 from, int32 to)
+{
+    int32 i, offset = y * c->stride;
+    for (i = from; i <= to; i++)
+    {
+        size_t carry = bits[i];
+        int32 j;
+        for (j = 0; carry && j < c->plane_count; j++)
+        {
+            size_t *p = &c->planes[j][offset + i];
+            size_t sum = *p ^ carry;
+            carry &= *p;
+            *p = sum;
+        }
+    }
+}
+
+/* Puts the row of words with ones where counters of row y exceed t. */
+static void counter_compare(Counter *c, int32 y, int32 t, size_t *result)
+{
+    int32 i, offset = y * c->stride;
+    for (i = 0; i < c->stride; i++)
+    {
+        size_t greater = 0, equal = ~(size_t) 0;
+        int32 j;
+        for (j = c->plane_count - 1; j >= 0; j--)
+        {
+            size_t p = c->planes[j][offset + i];
+            if ((t >> j) & 1)
+                equal &= p;
+            else
+            {
+                greater |= equal & p;
+                equal &= ~p;
+            }
+        }
+        result[i] = greater;
+    }
+}
+
+/* Puts a packed row of w pixels to `dst', shifting it right by `shift' bits.
+ * The destination should be zeroed.
+ */
+static void shift_row(unsigned char *dst, const unsigned char *src,
+                      int32 w, int32 shift)
+{
+    int32 n = (w + 7) >> 3, i;
+    int s = shift & 7;
+    unsigned char last = (unsigned char) (0xFF << ((8 - (w & 7)) & 7));
+    dst += shift >> 3;
+    for (i = 0; i < n; i++)
+    {
+        unsigned char b = src[i];
+        if (i == n - 1) b &= last;
+        dst[i] |= (unsigned char) (b >> s);
+        if (s) dst[i + 1] |= (unsigned char) (b << (8 - s));
+    }
+}
+
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_average(mdjvu_bitmap_t *bitmaps,
                                              int32 n,
                                              int32 *cx, int32 *cy)
 {
     int32 i;
     int32 min_x = 0, min_y = 0, max_x_plus_1 = 0, max_y_plus_1 = 0;
-    int32 *buf;
-    int32 buf_w, buf_h;
-    unsigned char *row;
+    Counter counter;
+    size_t *row;
+    int32 buf_w, buf_h, row_size;
     int32 tmp_x, tmp_y;
     int32 threshold = n / 2;
     mdjvu_bitmap_t result;
@@ -44,44 +144,41 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_average(mdjvu_bitmap_t *bitmaps,
 
     buf_w = max_x_plus_1 - min_x;
     buf_h = max_y_plus_1 - min_y;
-    buf = (int32 *) calloc(buf_w * buf_h, sizeof(int32));
-    row = (unsigned char *) malloc(buf_w);
+    row_size = (buf_w + 7) >> 3;
+    counter_init(&counter, buf_w, buf_h, n);
+    /* one more word for bits shifted out of the last byte */
+    row = (size_t *) calloc(counter.stride + 1, sizeof(size_t));
 
-    /* Now adding the bitmaps to the buffer */
+    /* Now adding the bitmaps to the counters */
     for (i = 0; i < n; i++)
     {
         int32 w = mdjvu_bitmap_get_width(bitmaps[i]);
         int32 h = mdjvu_bitmap_get_height(bitmaps[i]);
         int32 sx = min_x + cx[i] / MDJVU_CENTER_QUANT, sy = min_y + cy[i] / MDJVU_CENTER_QUANT;
-        int32 x, y;
+        int32 from = (-sx >> 3) / WORD_BYTES;
+        int32 to = ((w - 1 - sx) >> 3) / WORD_BYTES;
+        int32 y;
 
         for (y = 0; y < h; y++)
         {
-            int32 *buf_row = buf + buf_w * (y - sy);
-            mdjvu_bitmap_unpack_row(bitmaps[i], row, y);
-            for (x = 0; x < w; x++)
-            {
-                if (row[x])
-                    buf_row[x - sx]++;
-            }
+            memset(row + from, 0, (to - from + 1) * sizeof(size_t));
+            shift_row((unsigned char *) row,
+                      mdjvu_bitmap_access_packed_row(bitmaps[i], y), w, -sx);
+            counter_add(&counter, y - sy, row, from, to);
         }
     }
 
     result = mdjvu_bitmap_create(buf_w, buf_h);
     for (i = 0; i < buf_h; i++)
     {
-        int32 j;
-        for (j = 0; j < buf_w; j++)
-        {
-            row[j] = ( buf[i * buf_w + j] > threshold ? 1 : 0 );
-        }
-        mdjvu_bitmap_pack_row(result, row, i);
+        counter_compare(&counter, i, threshold, row);
+        memcpy(mdjvu_bitmap_access_packed_row(result, i), row, row_size);
     }
 
     mdjvu_bitmap_remove_margins(result, &tmp_x, &tmp_y);
 
     free(row);
-    free(buf);
+    counter_free(&counter);
 
     return result;
 }
@@ -0,0 +1,44 @@
+/*
+ * bitwords.h - reading packed rows 32 pixels at a time
+ * (shared by split.c and adjust_y.c; include after minidjvu-mod.h)
+ */
+
+#ifndef MDJVU_BITWORDS_H
+#define MDJVU_BITWORDS_H
+
+static int count_leading_zeros(uint32 x) /* x must not be 0 */
+{
+#if defined(__GNUC__) && __GNUC__ >= 4
+    return __builtin_clz(x);
+#else
+    int n = 0;
+    if (!(x & 0xFFFF0000)) { n += 16; x <<= 16; }
+    if (!(x & 0xFF000000)) { n +=  8; x <<=  8; }
+    if (!(x & 0xF0000000)) { n +=  4; x <<=  4; }
+    if (!(x & 0xC0000000)) { n +=  2; x <<=  2; }
+    if (!(x & 0x80000000)) n++;
+    return n;
+#endif
+}
+
+/* 32 pixels starting from byte i, the first one in the highest bit.
+ * Bytes past the end of the row read as 0.
+ */
+static uint32 get_word(const unsigned char *row, int32 i, int32 row_size)
+{
+    uint32 word = 0;
+    int k;
+    if (i + 4 <= row_size)
+    {
+        return (uint32) row[i] << 24 | (uint32) row[i + 1] << 16
+             | (uint32) row[i + 2] << 8 | row[i + 3];
+    }
+    for (k = 0; k < 4; k++)
+    {
+        word <<= 8;
+        if (i + k < row_size) word |= row[i + k];
+    }
+    return word;
+}
+
+#endif
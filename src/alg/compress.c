@@ -89,25 +89,40 @@ static void find_substitutions(mdjvu_image_t image,
     else
     {
         /* Average */
-        mdjvu_bitmap_t *sources = (mdjvu_bitmap_t *) calloc(n, sizeof(mdjvu_bitmap_t));
+        mdjvu_bitmap_t *sources = (mdjvu_bitmap_t *) malloc(n * sizeof(mdjvu_bitmap_t));
+        int32 *start = (int32 *) calloc(max_tag + 2, sizeof(int32));
+
+        /* Group the bitmaps by tags: bitmaps of tag i go to
+         * sources[start[i] .. start[i + 1] - 1], in their order.
+         */
+        for (i = 0; i < n; i++)
+            start[tags[i] + 1]++;
+        for (i = 0; i <= max_tag; i++)
+            start[i + 1] += start[i];
+        for (i = 0; i < n; i++)
+        {
+            int32 k = start[tags[i]]++;
+            sources[k] = mdjvu_image_get_bitmap(image, i);
+            mdjvu_image_get_center(image, sources[k], &cx[k], &cy[k]);
+        }
+        for (i = max_tag + 1; i > 0; i--)
+            start[i] = start[i - 1];
+        start[0] = 0;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (i = 1; i < max_tag; i++)
+        {
+            representatives[i] = mdjvu_average(sources + start[i],
+                                               start[i + 1] - start[i],
+                                               cx + start[i], cy + start[i]);
+        }
+
+        /* Adding them in order of tags keeps bitmap indices stable */
         for (i = 1; i < max_tag; i++)
         {
-            int j, sources_found = 0;
-            mdjvu_bitmap_t rep;
-    
-            for (j = 0; j < n; j++)
-            {
-                if (tags[j] == i)
-                    sources[sources_found++] = mdjvu_image_get_bitmap(image, j);
-            }
-    
-            for (j = 0; j < sources_found; j++)
-                mdjvu_image_get_center(image, sources[j], &cx[j], &cy[j]);
-    
-            rep = mdjvu_average(sources, sources_found, cx, cy);
+            mdjvu_bitmap_t rep = representatives[i];
             mdjvu_image_add_bitmap(image, rep);
             mdjvu_image_set_substitution(image, rep, rep);
-            representatives[i] = rep;
         }
         
         mdjvu_image_disable_centers(image);
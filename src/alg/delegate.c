@@ -44,52 +44,67 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_multipage_choose_average_representatives
          mdjvu_bitmap_t *representatives,
          unsigned char *dictionary_flags)
 {
-    int32 page_number, tag;
+    int32 page_number, tag, i, total_bitmaps_passed = 0;
     mdjvu_bitmap_t *sources;
-    int32 *cx, *cy;
+    int32 *cx, *cy, *start;
     mdjvu_image_t dictionary = mdjvu_image_create(0,0); /* 0 x 0 image */
 
     memset(representatives, 0, (max_tag + 1) * sizeof(mdjvu_bitmap_t));
 
+    /* Group the bitmaps by tags in one pass: bitmaps of a tag go to
+     * sources[start[tag] .. start[tag + 1] - 1] in the order of pages.
+     */
+    start = (int32 *) calloc(max_tag + 2, sizeof(int32));
+    for (i = 0; i < total_count; i++)
+        start[tags[i] + 1]++;
+    for (tag = 0; tag <= max_tag; tag++)
+        start[tag + 1] += start[tag];
+
     sources = (mdjvu_bitmap_t *) malloc(total_count * sizeof(mdjvu_bitmap_t));
     cx = (int32 *) malloc(total_count * sizeof(int32));
     cy = (int32 *) malloc(total_count * sizeof(int32));
 
-    for (tag = 1; tag < max_tag; tag++)
+    for (page_number = 0; page_number < npages; page_number++)
     {
-        int32 sources_found = 0, total_bitmaps_passed = 0;
-        mdjvu_bitmap_t rep;
-        if (!dictionary_flags[tag]) continue;
+        mdjvu_image_t page = pages[page_number];
+        int32 bitmap_count = mdjvu_image_get_bitmap_count(page);
 
-        memset(sources, 0, total_count * sizeof(mdjvu_bitmap_t));
-        memset(cx, 0, total_count * sizeof(int32));
-        memset(cy, 0, total_count * sizeof(int32));
-        for (page_number = 0; page_number < npages; page_number++)
+        for (i = 0; i < bitmap_count; i++) /* index of bitmap in a page */
         {
-            mdjvu_image_t page = pages[page_number];
-            int32 bitmap_count = mdjvu_image_get_bitmap_count(page);
-            int32 i; /* index of bitmap in a page */
-    
-            for (i = 0; i < bitmap_count; i++)
-            {
-                if (tags[total_bitmaps_passed++] == tag)
-                {
-                    sources[sources_found] = mdjvu_image_get_bitmap(page, i);
-                    mdjvu_image_get_center(page, sources[sources_found], &cx[sources_found], &cy[sources_found]);
-                    sources_found++;
-                }
-            }
+            int32 t = tags[total_bitmaps_passed++];
+            int32 k = start[t]++;
+            if (!t || t == max_tag || !dictionary_flags[t]) continue;
+            sources[k] = mdjvu_image_get_bitmap(page, i);
+            mdjvu_image_get_center(page, sources[k], &cx[k], &cy[k]);
         }
+    }
 
-        if (sources_found)
-        {
-            rep = mdjvu_average(sources, sources_found, cx, cy);
-            representatives[tag] = rep;
-        }
+    /* start[tag] has moved to the start of tag + 1 */
+    for (tag = max_tag + 1; tag > 0; tag--)
+        start[tag] = start[tag - 1];
+    start[0] = 0;
+
+    /* Tags don't share anything, so they are averaged in parallel.
+     * This is called from a task of the encoder, where a nested parallel
+     * region would get one thread; tasks go to the idle threads instead.
+     * Their number is bounded: with too many queued tasks, libgomp runs
+     * the whole loop in this thread.
+     */
+    #pragma omp taskloop num_tasks(64)
+    for (tag = 1; tag < max_tag; tag++)
+    {
+        int32 sources_found = start[tag + 1] - start[tag];
+        if (!dictionary_flags[tag] || !sources_found) continue;
+
+        representatives[tag] = mdjvu_average(sources + start[tag],
+                                             sources_found,
+                                             cx + start[tag],
+                                             cy + start[tag]);
     }
     free(cx);
     free(cy);
     free(sources);
+    free(start);
 
     for (page_number = 0; page_number < npages; page_number++)
         mdjvu_image_disable_centers(pages[page_number]);
@@ -26,24 +26,88 @@
  */
 
 
-/* all input rows must be 0-or-1 unpacked */
+#define WORD_BYTES ((int32) sizeof(size_t))
+#define WORD_BITS (8 * WORD_BYTES)
+
+/* Loads a word of a packed row starting from byte `i', the first pixel
+ * going to the highest bit. Bytes past the row are zeros.
+ */
+static size_t load_word(const unsigned char *row, int32 i, int32 row_size)
+{
+    size_t result = 0;
+    int32 j;
+    for (j = 0; j < WORD_BYTES; j++)
+    {
+        result <<= 8;
+        if (i + j < row_size) result |= row[i + j];
+    }
+    return result;
+}
+
+static void store_word(unsigned char *row, int32 i, int32 row_size, size_t w)
+{
+    int32 j;
+    for (j = WORD_BYTES - 1; j >= 0; j--)
+    {
+        if (i + j < row_size) row[i + j] = (unsigned char) w;
+        w >>= 8;
+    }
+}
+
+/* Bits that are set in exactly 2 of a, b, c, d. */
+static size_t exactly_2_of_4(size_t a, size_t b, size_t c, size_t d)
+{
+    return ((a ^ b) & (c ^ d))
+         | (a & b & ~(c | d))
+         | (c & d & ~(a | b));
+}
+
+/* Finds candidates in the packed row `t' between rows `u' and `l'. */
 static void get_erosion_candidates_in_a_row(
                        unsigned char *r, /* result    */
-                       unsigned char *u, /* upper row */
-                       unsigned char *t, /* this row */
-                       unsigned char *l, /* lower row */
+                       const unsigned char *u, /* upper row */
+                       const unsigned char *t, /* this row */
+                       const unsigned char *l, /* lower row */
                        int32 n)
 {
+    int32 row_size = (n + 7) >> 3;
+    size_t u_prev = 0, t_prev = 0, l_prev = 0;
+    size_t u_cur = load_word(u, 0, row_size);
+    size_t t_cur = load_word(t, 0, row_size);
+    size_t l_cur = load_word(l, 0, row_size);
     int32 i;
-    n--;
-    r[0] = 0;
-    r[n] = 0;
-    for (i = 1; i < n; i++)
-    {
-        int score_4 = u[i] + l[i] + t[i-1] + t[i+1] - 2;
-        int score_d = u[i-1] + l[i-1] + u[i+1] + l[i+1] - 2;
 
-        r[i] = !score_4 && !score_d ? 1 : 0;
+    for (i = 0; i < row_size; i += WORD_BYTES)
+    {
+        size_t u_next = load_word(u, i + WORD_BYTES, row_size);
+        size_t t_next = load_word(t, i + WORD_BYTES, row_size);
+        size_t l_next = load_word(l, i + WORD_BYTES, row_size);
+
+        /* neighbors to the left and to the right, aligned with the pixel */
+        size_t ul = (u_cur >> 1) | (u_prev << (WORD_BITS - 1));
+        size_t ur = (u_cur << 1) | (u_next >> (WORD_BITS - 1));
+        size_t tl = (t_cur >> 1) | (t_prev << (WORD_BITS - 1));
+        size_t tr = (t_cur << 1) | (t_next >> (WORD_BITS - 1));
+        size_t ll = (l_cur >> 1) | (l_prev << (WORD_BITS - 1));
+        size_t lr = (l_cur << 1) | (l_next >> (WORD_BITS - 1));
+
+        size_t res = exactly_2_of_4(u_cur, l_cur, tl, tr)
+                   & exactly_2_of_4(ul, ur, ll, lr);
+
+        /* never the first or the last pixel of the row */
+        if (i == 0)
+            res &= ~((size_t) 1 << (WORD_BITS - 1));
+        if (n - 1 - 8 * i < WORD_BITS)
+        {
+            int32 keep = n - 1 - 8 * i; /* pixels before the last one */
+            res = keep ? res & (~(size_t) 0 << (WORD_BITS - keep)) : 0;
+        }
+
+        store_word(r, i, row_size, res);
+
+        u_prev = u_cur; u_cur = u_next;
+        t_prev = t_cur; t_cur = t_next;
+        l_prev = l_cur; l_cur = l_next;
     }
 }
 
@@ -53,34 +117,18 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_get_erosion_mask(mdjvu_bitmap_t bmp)
     int32 h = mdjvu_bitmap_get_height(bmp);
     mdjvu_bitmap_t result = mdjvu_bitmap_create(w, h);
     int32 i;
-    unsigned char *u, *t, *l, *r;
-
-    if (h < 3) return result;
 
-    u = (unsigned char *) malloc(w); /* upper row */
-    t = (unsigned char *) malloc(w); /* this row */
-    l = (unsigned char *) malloc(w); /* lower row */
-    r = (unsigned char *) malloc(w); /* result */
+    if (h < 3 || w < 3) return result;
 
-    mdjvu_bitmap_unpack_row_0_or_1(bmp, t, 0);
-    mdjvu_bitmap_unpack_row_0_or_1(bmp, l, 1);
     for (i = 1; i < h - 1; i++)
     {
-        unsigned char *tmp = u;
-        u = t;
-        t = l;
-        l = tmp;
-
-        mdjvu_bitmap_unpack_row_0_or_1(bmp, l, i + 1);
-
-        get_erosion_candidates_in_a_row(r, u, t, l, w);
-        mdjvu_bitmap_pack_row(result, r, i);
+        get_erosion_candidates_in_a_row(
+            mdjvu_bitmap_access_packed_row(result, i),
+            mdjvu_bitmap_access_packed_row(bmp, i - 1),
+            mdjvu_bitmap_access_packed_row(bmp, i),
+            mdjvu_bitmap_access_packed_row(bmp, i + 1),
+            w);
     }
 
-    free(u);
-    free(t);
-    free(l);
-    free(r);
-
     return result;
 }
@@ -3,14 +3,17 @@
  */
 
 /*
- * This implementation is very dumb and sub-optimal,
- * but since it's not a bottleneck, I'm not going to optimize it.
+ * Blits are put into a uniform grid by their boxes, so that only blits
+ * sharing a grid cell are checked for intersection. The infection spreads
+ * through an explicit queue rather than recursion, since pictures
+ * and halftones make very long chains of touching blits.
  */
 
 
 #include "../base/mdjvucfg.h"
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <assert.h>
+#include <stdlib.h>
 
 
 /*
@@ -37,32 +40,164 @@ static int blits_intersect_or_touch(mdjvu_image_t image, int32 b1, int32 b2)
         && segments_intersect_or_touch(y1, h1, y2, h2);
 }
 
-static void make_no_subst(mdjvu_image_t image, int32 blit)
+/* ____________________________   blit grid   ______________________________ */
+
+/* Blits in cell c are blits[start[c] .. start[c + 1] - 1].
+ * A blit is in every cell its box touches, the box being
+ * [x, x + w] x [y, y + h] as in blits_intersect_or_touch().
+ */
+typedef struct
+{
+    int32 min_x, min_y;
+    int32 cell_size;
+    int32 grid_w, grid_h;
+    int32 *start;
+    int32 *blits;
+} Grid;
+
+static void get_cells(Grid *g, mdjvu_image_t image, int32 blit,
+                      int32 *x0, int32 *y0, int32 *x1, int32 *y1)
+{
+    int32 x = mdjvu_image_get_blit_x(image, blit);
+    int32 y = mdjvu_image_get_blit_y(image, blit);
+    mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(image, blit);
+    *x0 = (x - g->min_x) / g->cell_size;
+    *y0 = (y - g->min_y) / g->cell_size;
+    *x1 = (x + mdjvu_bitmap_get_width(bitmap) - g->min_x) / g->cell_size;
+    *y1 = (y + mdjvu_bitmap_get_height(bitmap) - g->min_y) / g->cell_size;
+}
+
+static void grid_init(Grid *g, mdjvu_image_t image)
+{
+    int32 b = mdjvu_image_get_blit_count(image);
+    int32 max_x = 0, max_y = 0;
+    int32 i, pass, cell_count;
+
+    g->min_x = g->min_y = 0;
+    for (i = 0; i < b; i++)
+    {
+        int32 x = mdjvu_image_get_blit_x(image, i);
+        int32 y = mdjvu_image_get_blit_y(image, i);
+        mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(image, i);
+        int32 x1 = x + mdjvu_bitmap_get_width(bitmap);
+        int32 y1 = y + mdjvu_bitmap_get_height(bitmap);
+        if (!i || x < g->min_x) g->min_x = x;
+        if (!i || y < g->min_y) g->min_y = y;
+        if (!i || x1 > max_x) max_x = x1;
+        if (!i || y1 > max_y) max_y = y1;
+    }
+
+    /* about as many cells as blits */
+    g->cell_size = 1;
+    while ((double) ((max_x - g->min_x) / g->cell_size + 1)
+                  * ((max_y - g->min_y) / g->cell_size + 1) > b)
+    {
+        g->cell_size *= 2;
+    }
+    g->grid_w = (max_x - g->min_x) / g->cell_size + 1;
+    g->grid_h = (max_y - g->min_y) / g->cell_size + 1;
+    cell_count = g->grid_w * g->grid_h;
+
+    /* count, then fill */
+    g->start = (int32 *) calloc(cell_count + 1, sizeof(int32));
+    g->blits = NULL;
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < b; i++)
+        {
+            int32 x0, y0, x1, y1, cx, cy;
+            get_cells(g, image, i, &x0, &y0, &x1, &y1);
+            for (cy = y0; cy <= y1; cy++) for (cx = x0; cx <= x1; cx++)
+            {
+                int32 c = cy * g->grid_w + cx;
+                if (pass)
+                    g->blits[g->start[c]++] = i;
+                else
+                    g->start[c + 1]++;
+            }
+        }
+
+        if (pass)
+        {
+            /* start[c] has moved to the start of cell c + 1 */
+            for (i = cell_count; i > 0; i--)
+                g->start[i] = g->start[i - 1];
+            g->start[0] = 0;
+        }
+        else
+        {
+            for (i = 0; i < cell_count; i++)
+                g->start[i + 1] += g->start[i];
+            g->blits = (int32 *)
+                malloc((g->start[cell_count] + 1) * sizeof(int32));
+        }
+    }
+}
+
+static void grid_free(Grid *g)
+{
+    free(g->start);
+    free(g->blits);
+}
+
+/* ___________________________   infection   ________________________________ */
+
+/* Flags the blit's bitmap and queues the blit, unless the bitmap is flagged.
+ * (A blit whose bitmap was flagged through another blit doesn't spread.)
+ */
+static void make_no_subst(mdjvu_image_t image, int32 blit,
+                          int32 *queue, int32 *queue_end)
 {
-    int32 i, b;
     mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(image, blit);
     if (mdjvu_image_get_not_a_letter_flag(image, bitmap)) return;
     mdjvu_image_set_not_a_letter_flag(image, bitmap, 1);
+    queue[(*queue_end)++] = blit;
+}
 
-    /* infect all blits that intersect with this */
-    b = mdjvu_image_get_blit_count(image);
-    for (i = 0; i < b; i++)
+/* Infects all blits that intersect with the queued ones. */
+static void spread_no_subst(mdjvu_image_t image, Grid *g,
+                            int32 *queue, int32 *queue_end)
+{
+    int32 done = 0;
+    while (done < *queue_end)
     {
-        if (blits_intersect_or_touch(image, blit, i))
-            make_no_subst(image, i);
+        int32 blit = queue[done++];
+        int32 x0, y0, x1, y1, cx, cy;
+        get_cells(g, image, blit, &x0, &y0, &x1, &y1);
+        for (cy = y0; cy <= y1; cy++) for (cx = x0; cx <= x1; cx++)
+        {
+            int32 c = cy * g->grid_w + cx;
+            int32 j;
+            for (j = g->start[c]; j < g->start[c + 1]; j++)
+            {
+                int32 i = g->blits[j];
+                if (blits_intersect_or_touch(image, blit, i))
+                    make_no_subst(image, i, queue, queue_end);
+            }
+        }
     }
 }
 
 MDJVU_IMPLEMENT void mdjvu_calculate_not_a_letter_flags(mdjvu_image_t image)
 {
-    int32 i, b;
+    int32 i, b, queue_end = 0;
+    int32 *queue;
+    Grid grid;
     assert(mdjvu_image_has_suspiciously_big_flags(image));
     mdjvu_image_enable_not_a_letter_flags(image);
     b = mdjvu_image_get_blit_count(image);
+    if (!b) return;
+
+    grid_init(&grid, image);
+    queue = (int32 *) malloc(b * sizeof(int32));
     for (i = 0; i < b; i++)
     {
         mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(image, i);
         if (mdjvu_image_get_suspiciously_big_flag(image, bitmap))
-            make_no_subst(image, i);
+            make_no_subst(image, i, queue, &queue_end);
     }
+    spread_no_subst(image, &grid, queue, &queue_end);
+
+    free(queue);
+    grid_free(&grid);
 }
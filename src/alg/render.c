@@ -7,21 +7,74 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Returns 8 bits of a packed row starting from bit p (p > -8).
+ * Bits before the row and after byte `last' are taken as zeros.
+ */
+static unsigned char get_byte(const unsigned char *row, int32 p, int32 last)
+{
+    int32 i;
+    int s;
+
+    if (p < 0) return (unsigned char) (row[0] >> -p);
+    i = p >> 3;
+    s = p & 7;
+    if (!s) return row[i];
+    if (i < last)
+        return (unsigned char) ((row[i] << s) | (row[i + 1] >> (8 - s)));
+    return (unsigned char) (row[i] << s);
+}
+
+/* ORs n bits of a packed row `src', starting from bit sx,
+ * into a packed row `dst', starting from bit dx.
+ */
+static void or_bits(unsigned char *dst, int32 dx,
+                    const unsigned char *src, int32 sx, int32 n)
+{
+    int32 k = dx >> 3;
+    int32 last = (dx + n - 1) >> 3;
+    int32 src_last = (sx + n - 1) >> 3;
+    int32 p = sx - (dx & 7); /* the source bit going to the top of dst[k] */
+    unsigned char first_mask = (unsigned char) (0xFF >> (dx & 7));
+    unsigned char last_mask = (unsigned char) (0xFF << (7 - ((dx+n-1) & 7)));
+
+    if (k == last)
+    {
+        dst[k] |= get_byte(src, p, src_last) & first_mask & last_mask;
+        return;
+    }
+
+    dst[k++] |= get_byte(src, p, src_last) & first_mask;
+    p += 8;
+
+    if (!(p & 7))
+    {
+        /* aligned: whole bytes go as they are */
+        int32 i = p >> 3;
+        for (; k < last; k++, i++)
+            dst[k] |= src[i];
+        p = i << 3;
+    }
+    else
+    {
+        int s = p & 7;
+        int32 i = p >> 3;
+        for (; k < last; k++, i++)
+            dst[k] |= (unsigned char) ((src[i] << s) | (src[i + 1] >> (8-s)));
+        p = (i << 3) + s;
+    }
+
+    dst[last] |= get_byte(src, p, src_last) & last_mask;
+}
+
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_render(mdjvu_image_t img)
 {
     int32 width  = mdjvu_image_get_width (img);
     int32 height = mdjvu_image_get_height(img);
-    unsigned char **b = mdjvu_create_2d_array(width, height);
-    unsigned char *row_buffer = (unsigned char *) malloc(width);
     int32 blit_count = mdjvu_image_get_blit_count(img);
     int32 i;
-    mdjvu_bitmap_t result = mdjvu_bitmap_create(width, height);
-
-    /* Fill the canvas with white */
-    for (i = 0; i < height; i++)
-        memset(b[i], 0, width);
+    mdjvu_bitmap_t result = mdjvu_bitmap_create(width, height); /* white */
 
-    /* Render the split image blit by blit */
+    /* Render the split image blit by blit, OR-ing packed rows */
     for (i = 0; i < blit_count; i++)
     {
         int32 x = mdjvu_image_get_blit_x(img, i);
@@ -42,21 +95,210 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_render(mdjvu_image_t img)
 
         int32 row;
 
+        if (min_col >= max_col_plus_one) continue;
+
         /* Render the current blit row by row */
         for (row = min_row; row < max_row_plus_one; row++)
         {
-            int32 col;
-            unsigned char *target = b[y + row] + x;
-            mdjvu_bitmap_unpack_row(current_bitmap, row_buffer, row);
-            for (col = min_col; col < max_col_plus_one; col++)
-                target[col] |= row_buffer[col];
+            or_bits(mdjvu_bitmap_access_packed_row(result, y + row),
+                    x + min_col,
+                    mdjvu_bitmap_access_packed_row(current_bitmap, row),
+                    min_col, max_col_plus_one - min_col);
+        }
+    }
+
+    return result;
+}
+
+/* __________________________   region rendering   _________________________ */
+
+/* Blits are bucketed by bands of this many region rows;
+ * it's a multiple of any scale.
+ */
+#define REGION_BAND_HEIGHT 64
+
+static int count_bits(int v)
+{
+    v = (v & 0x55) + ((v >> 1) & 0x55);
+    v = (v & 0x33) + ((v >> 2) & 0x33);
+    return (v & 0x0F) + (v >> 4);
+}
+
+/* Renders a region into either a graymap or a bitmap (the other is NULL).
+ * The region is already checked to be nonempty.
+ */
+static void render_region(mdjvu_image_t img,
+                          int32 x, int32 y, int32 w, int32 h, int scale,
+                          unsigned char **gray,
+                          mdjvu_bitmap_t bitmap, int threshold)
+{
+    int32 width  = mdjvu_image_get_width (img);
+    int32 height = mdjvu_image_get_height(img);
+    int32 blit_count = mdjvu_image_get_blit_count(img);
+    int32 out_w = (w + scale - 1) / scale;
+    int32 out_h = (h + scale - 1) / scale;
+    int32 row_size = (w + 7) >> 3;
+    int32 band_count = (h + REGION_BAND_HEIGHT - 1) / REGION_BAND_HEIGHT;
+    int32 *band_start = (int32 *) calloc(band_count + 1, sizeof(int32));
+    int32 *band_blits = NULL;
+    unsigned char *rows = (unsigned char *) malloc(scale * row_size);
+    int32 count_size = row_size * 8 / scale; /* padding bits get counts too */
+    int32 *counts = (int32 *) malloc(count_size * sizeof(int32));
+    unsigned char *out_row = (unsigned char *) malloc(out_w);
+    int group_mask = (1 << scale) - 1;
+    int32 left = x > 0 ? x : 0;                 /* visible page columns */
+    int32 right = x + w < width ? x + w : width;
+    int32 top = y > 0 ? y : 0;                  /* visible page rows */
+    int32 bottom = y + h < height ? y + h : height;
+    int32 i, b, oy;
+
+    if (left >= right || top >= bottom)
+        blit_count = 0; /* nothing of the page is visible */
+
+    /* Index the blits that touch the visible part by bands they cross */
+    for (b = 0; b < 2; b++)
+    {
+        for (i = 0; i < blit_count; i++)
+        {
+            int32 bx = mdjvu_image_get_blit_x(img, i);
+            int32 by = mdjvu_image_get_blit_y(img, i);
+            mdjvu_bitmap_t current_bitmap = mdjvu_image_get_blit_bitmap(img, i);
+            int32 bw = mdjvu_bitmap_get_width(current_bitmap);
+            int32 bh = mdjvu_bitmap_get_height(current_bitmap);
+            int32 k, k_end;
+
+            if (bx >= right || bx + bw <= left) continue;
+            if (by >= bottom || by + bh <= top) continue;
+
+            k = ((by > top ? by : top) - y) / REGION_BAND_HEIGHT;
+            k_end = ((by + bh < bottom ? by + bh : bottom) - 1 - y)
+                  / REGION_BAND_HEIGHT;
+            for (; k <= k_end; k++)
+            {
+                if (b)
+                    band_blits[band_start[k]++] = i;
+                else
+                    band_start[k + 1]++;
+            }
+        }
+
+        if (b)
+        {
+            /* band_start[k] has moved to the start of band k + 1 */
+            for (i = band_count; i > 0; i--)
+                band_start[i] = band_start[i - 1];
+            band_start[0] = 0;
+        }
+        else
+        {
+            for (i = 0; i < band_count; i++)
+                band_start[i + 1] += band_start[i];
+            band_blits = (int32 *)
+                malloc((band_start[band_count] + 1) * sizeof(int32));
+        }
+    }
+
+    for (oy = 0; oy < out_h; oy++)
+    {
+        int32 sy = oy * scale;  /* the first source row, counted from y */
+        int32 rows_here = h - sy < scale ? h - sy : scale;
+        int32 k = sy / REGION_BAND_HEIGHT;
+        int32 j, ox;
+
+        /* OR the blits into `scale' packed rows */
+        memset(rows, 0, scale * row_size);
+        for (j = band_start[k]; j < band_start[k + 1]; j++)
+        {
+            int32 n = band_blits[j];
+            int32 bx = mdjvu_image_get_blit_x(img, n);
+            int32 by = mdjvu_image_get_blit_y(img, n);
+            mdjvu_bitmap_t current_bitmap = mdjvu_image_get_blit_bitmap(img, n);
+            int32 bw = mdjvu_bitmap_get_width(current_bitmap);
+            int32 bh = mdjvu_bitmap_get_height(current_bitmap);
+            int32 c0 = bx > left ? bx : left;
+            int32 c1 = bx + bw < right ? bx + bw : right;
+            int32 r0 = y + sy, r1 = y + sy + rows_here;
+            int32 r;
+
+            if (r0 < by) r0 = by;
+            if (r0 < top) r0 = top;
+            if (r1 > by + bh) r1 = by + bh;
+            if (r1 > bottom) r1 = bottom;
+
+            for (r = r0; r < r1; r++)
+            {
+                or_bits(rows + (r - y - sy) * row_size, c0 - x,
+                        mdjvu_bitmap_access_packed_row(current_bitmap, r - by),
+                        c0 - bx, c1 - c0);
+            }
+        }
+
+        /* Count black pixels in each scale x scale square */
+        memset(counts, 0, count_size * sizeof(int32));
+        for (j = 0; j < rows_here; j++)
+        {
+            unsigned char *row = rows + j * row_size;
+            int32 byte;
+            for (byte = 0; byte < row_size; byte++)
+            {
+                int v = row[byte];
+                int shift;
+                if (!v) continue;
+                ox = byte * 8 / scale;
+                for (shift = 8 - scale; shift >= 0; shift -= scale, ox++)
+                    counts[ox] += count_bits((v >> shift) & group_mask);
+            }
+        }
+
+        for (ox = 0; ox < out_w; ox++)
+        {
+            int32 cols_here = w - ox * scale < scale ? w - ox * scale : scale;
+            out_row[ox] = (unsigned char)
+                ((counts[ox] * 255 + cols_here * rows_here / 2)
+                    / (cols_here * rows_here));
+        }
+
+        if (gray)
+            memcpy(gray[oy], out_row, out_w);
+        else
+        {
+            for (ox = 0; ox < out_w; ox++)
+                out_row[ox] = out_row[ox] >= threshold;
+            mdjvu_bitmap_pack_row(bitmap, out_row, oy);
         }
     }
 
-    free(row_buffer);
+    free(out_row);
+    free(counts);
+    free(rows);
+    free(band_blits);
+    free(band_start);
+}
 
-    /* Convert 2D array to a Bitmap and return it */
-    mdjvu_bitmap_pack_all(result, b);
-    mdjvu_destroy_2d_array(b);
+static int region_is_valid(int32 w, int32 h, int scale)
+{
+    return w > 0 && h > 0 &&
+        (scale == 1 || scale == 2 || scale == 4 || scale == 8);
+}
+
+MDJVU_IMPLEMENT unsigned char **mdjvu_render_region(mdjvu_image_t img,
+    int32 x, int32 y, int32 w, int32 h, int scale)
+{
+    unsigned char **result;
+    if (!region_is_valid(w, h, scale)) return NULL;
+    result = mdjvu_create_2d_array((w + scale - 1) / scale,
+                                   (h + scale - 1) / scale);
+    render_region(img, x, y, w, h, scale, result, NULL, 0);
+    return result;
+}
+
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_render_region_bitmap(mdjvu_image_t img,
+    int32 x, int32 y, int32 w, int32 h, int scale, int threshold)
+{
+    mdjvu_bitmap_t result;
+    if (!region_is_valid(w, h, scale)) return NULL;
+    result = mdjvu_bitmap_create((w + scale - 1) / scale,
+                                 (h + scale - 1) / scale);
+    render_region(img, x, y, w, h, scale, NULL, result, threshold);
     return result;
 }
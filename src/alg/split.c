@@ -7,6 +7,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include "bitwords.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /* _______________________   managing splitter options   ___________________ */
 
@@ -29,189 +33,475 @@ void mdjvu_split_options_destroy(mdjvu_split_options_t opt)
     free(opt);
 }
 
-/* _________________________   interpreting runs   _________________________ */
-
-/* Runs are stored in a "map".
- * A map entry may be 0 (same-as-prev), BLACK_RUN(1) and WHITE_RUN(2).
- * Each run is started by BLACK_RUN or WHITE_RUN and continues with zeros.
- * First run is white.
- *
- * Here's an example:
- *
- *               map: 001002001000210
- *  interpreted line: 001110001111011
+/* ___________________________   finding runs   ____________________________ */
+
+/* Rows are read straight from the packed bitmap, 32 pixels at a time.
+ * A run is a maximal horizontal segment of black pixels.
  */
-#define BLACK_RUN 1
-#define WHITE_RUN 2
-
-/* This function does three things simultaneously:
- *    1) renders `map' into `result_line' and applies AND with line
- *    2) deletes black pixels in `line'
- *    3) clears `map' including the last (max_x + 1) column
- *
- * Indices in `map'         are min_x..max_x.
- * Indices in `line'        are min_x..max_x.
- * Indices in `result_line' are 0..max_x-min_x.
- *
+
+/* Returns the first x' >= x such that the pixel x' is `black' (0 or 1),
+ * or w if there's none.
  */
-static void interpret_runs_in_a_line(int32 min_x, int32 max_x,
-                                     unsigned char *map,
-                                     unsigned char *result_line,
-                                     unsigned char *line)
-{
-    int32 i = min_x;
-    memset(result_line, 0, max_x - min_x + 1);
-    map[max_x + 1] = 0;
-    while (1)
+static int32 find_pixel(const unsigned char *row, int32 w, int32 x, int black)
+{
+    int32 row_size = (w + 7) >> 3;
+    while (x < w)
     {
-        /* white run */
-        while (map[i] != BLACK_RUN)
+        int shift = x & 7;
+        uint32 word = get_word(row, x >> 3, row_size);
+        if (!black) word = ~word;
+        word <<= shift;
+        if (word)
         {
-            if (++i > max_x) return;
+            x += count_leading_zeros(word);
+            return x < w ? x : w;
         }
+        x += 32 - shift;
+    }
+    return w;
+}
+
+#define DEAD (-1)
 
-        map[i] = 0;
+typedef struct
+{
+    int32 x0, x1;   /* the first and the last black pixel */
+    int32 y;
+    int32 mark;     /* DEAD if already taken, otherwise the last shape seen */
 
-        /* black run */
-        while (map[i] != WHITE_RUN)
+    /* The first run in the row above (below) that ends at x0 or further.
+     * Only runs from up to x1 may touch this one.
+     */
+    int32 up, down;
+} Run;
+
+typedef struct
+{
+    Run *runs;      /* sorted by x */
+    int32 count, capacity;
+} RunRow;
+
+static void find_runs(RunRow *r, const unsigned char *row, int32 w, int32 y)
+{
+    int32 x = 0;
+    r->count = 0;
+    while ((x = find_pixel(row, w, x, 1)) < w)
+    {
+        int32 end = find_pixel(row, w, x, 0);
+        Run *run;
+        if (r->count == r->capacity)
         {
-            result_line[i - min_x] = line[i]; /* copy instead of paint */
-            line[i] = 0;
-            if (++i > max_x) return;
+            r->capacity = r->capacity ? 2 * r->capacity : 16;
+            r->runs = (Run *) realloc(r->runs, r->capacity * sizeof(Run));
         }
+        run = &r->runs[r->count++];
+        run->x0 = x;
+        run->x1 = end - 1;
+        run->y = y;
+        run->mark = 0;
+        run->up = run->down = 0;
+        x = end;
+    }
+}
 
-        map[i] = 0;
+/* Fills `up' in the lower row and `down' in the upper one. */
+static void link_runs(RunRow *upper, RunRow *lower)
+{
+    int32 i, j = 0;
+    for (i = 0; i < lower->count; i++)
+    {
+        while (j < upper->count && upper->runs[j].x1 < lower->runs[i].x0) j++;
+        lower->runs[i].up = j;
+    }
+    j = 0;
+    for (i = 0; i < upper->count; i++)
+    {
+        while (j < lower->count && lower->runs[j].x1 < upper->runs[i].x0) j++;
+        upper->runs[i].down = j;
     }
 }
 
-/* This function does the same as interpret_runs_in_a_line(),
- *    but on a rectangle.
- * Returns the rendered result.
- * Also clears it in pixels[][].
- * `map' is cleared.
- */
-static mdjvu_bitmap_t interpret_runs(int32 min_x, int32 max_x,
-                                     int32 min_y, int32 max_y,
-                                     unsigned char **map,
-                                     unsigned char **pixels)
-{
-    int32 w = max_x - min_x + 1;
-    int32 h = max_y - min_y + 1;
-    unsigned char *line_buf = (unsigned char *) malloc(w);
-    mdjvu_bitmap_t bmp = mdjvu_bitmap_create(w, h);
-    int32 y;
-    for (y = min_y; y <= max_y; y++)
+/* Sets pixels a..b in a packed row. */
+static void fill_bits(unsigned char *row, int32 a, int32 b)
+{
+    int32 i = a >> 3, j = b >> 3;
+    unsigned char left = (unsigned char) (0xFF >> (a & 7));
+    unsigned char right = (unsigned char) (0xFF << (7 - (b & 7)));
+    if (i == j)
     {
-        interpret_runs_in_a_line(min_x, max_x, map[y], line_buf, pixels[y]);
-        mdjvu_bitmap_pack_row(bmp, line_buf, y - min_y);
+        row[i] |= left & right;
+        return;
     }
-    free(line_buf);
-    return bmp;
+    row[i] |= left;
+    if (j - i > 1) memset(row + i + 1, 0xFF, j - i - 1);
+    row[j] |= right;
 }
 
-/* ________________________   walking along contours   _____________________ */
+/* _____________________________   the splitter   __________________________ */
 
-/* (start_x, start_y) should be the leftmost of the topmost black pixels.
- * Walking is counterclockwise.
- * map must be cleared.
+/* Holes are found through the gaps between runs of a shape in each row.
+ * A gap is outside if it's connected to the bounding box margin.
+ * Black pixels are 4-connected, so white ones are 8-connected.
  */
+typedef struct
+{
+    int32 x0, x1;
+    int32 row;      /* counted from the top of the shape */
+    int outside;
+} Gap;
 
-static void walk_around_a_black_contour(unsigned char **pixels,
-                                        unsigned char **map,
-                                        int32 start_x, int32 start_y,
-                                        int32 *pmin_x, int32 *pmax_x,
-                                        int32 *pmin_y, int32 *pmax_y)
-{
-    int32 x = start_x, y = start_y;   /* current black pixel */
-    int32 dx = 0, dy = 1;  /* vector along the contour*/
-                   /* it's always true that abs(dx) == 1 && dy == 0
-                    *                        ||
-                    *                       abs(dy) == 1 && dx == 0
-                    */
-
-    /* Bounding box. start_y will always be minimal y. */
-    int32 min_x = start_x;
-    int32 max_x = start_x;
-    int32 max_y = start_y;
-
-    /* Starting picture:
-     *
-     *      | w | w |
-     *      ----+---|
-     *      | w | b |  <- start_y
-     *            ^
-     *           start_x
-     *
-     *  and we're heading down
+typedef struct
+{
+    /* rows come either from the bitmap or from read_row() */
+    mdjvu_bitmap_t bitmap;
+    int (*read_row)(void *, unsigned char *, int32);
+    void *param;
+    unsigned char *row_buffer;
+    int failed;
+
+    int32 width, height;
+    int32 window;       /* row y is kept in rows[y % window] */
+    RunRow *rows;
+    int32 shape;        /* the current value for Run.mark */
+
+    Run **runs;         /* runs of the current shape */
+    int32 run_count, run_capacity;
+
+    /* Runs of the i-th shape row are within rows[...].runs[first[i]..last[i]]
+     * and its gaps start from gaps[gap_rows[i]].
      */
+    int32 *first, *last;
+    Gap *gaps;
+    int32 gap_count, gap_capacity;
+    int32 *gap_rows;
+    int32 *gap_stack;
+} Splitter;
+
+static void add_gap(Splitter *s, int32 row, int32 x0, int32 x1, int outside)
+{
+    Gap *g;
+    if (s->gap_count == s->gap_capacity)
+    {
+        s->gap_capacity = s->gap_capacity ? 2 * s->gap_capacity : 64;
+        s->gaps = (Gap *) realloc(s->gaps, s->gap_capacity * sizeof(Gap));
+        s->gap_stack = (int32 *)
+            realloc(s->gap_stack, s->gap_capacity * sizeof(int32));
+    }
+    g = &s->gaps[s->gap_count++];
+    g->x0 = x0;
+    g->x1 = x1;
+    g->row = row;
+    g->outside = outside;
+}
 
-    /* Generic picture (===> denotes contour fragment along (dx,dy)):
-     *
-     *  (1) | b | ? | (3)
-     *      ====>----
-     *  (2) | w | ? | (4)
-     *
-     *  ===> vector is (dx,dy)
-     *  up vector (that is, (dx,dy) rotated counterclockwise) is (dy, -dx).
-     *  down vector (that is, (dx,dy) rotated clockwise) is      (-dy, dx).
-     *  (the coordinate system is left)
-     */
+/* Collects the 4-connected shape of `start' within rows top..bottom
+ * into s->runs, marking its runs with a new s->shape.
+ * Returns the bounding box.
+ */
+static void collect_shape(Splitter *s, Run *start, int32 top, int32 bottom,
+                          int32 *pmin_x, int32 *pmax_x, int32 *pmax_y)
+{
+    int32 min_x = start->x0, max_x = start->x1, max_y = top;
+    int32 done;
 
-    /* MAIN IMAGE WALKING LOOP */
-    while (x != start_x || y != start_y || dx != -1)
+    start->mark = ++s->shape;
+    s->runs[0] = start;
+    s->run_count = 1;
+    for (done = 0; done < s->run_count; done++)
     {
-        assert(pixels[y][x] /* is black */);
+        Run *r = s->runs[done];
+        int d;
 
-        /* see if this pixel enlarges bbox */
-        if (x < min_x) min_x = x; else if (x > max_x) max_x = x;
-        if (y > max_y) max_y = y;
+        if (r->x0 < min_x) min_x = r->x0;
+        if (r->x1 > max_x) max_x = r->x1;
+        if (r->y > max_y) max_y = r->y;
 
-        /* fill contour map if needed */
-        if (dx == 0)
+        for (d = -1; d <= 1; d += 2)
         {
-            if (dy > 0)
-                map[y][x] = BLACK_RUN;
-            else
-                map[y][x + 1] = WHITE_RUN; /* map has the right margin */
+            int32 y = r->y + d;
+            RunRow *row;
+            int32 i;
+            if (y < top || y > bottom) continue;
+            row = &s->rows[y % s->window];
+            for (i = d < 0 ? r->up : r->down;
+                 i < row->count && row->runs[i].x0 <= r->x1; i++)
+            {
+                Run *n = &row->runs[i];
+                if (n->mark == DEAD || n->mark == s->shape) continue;
+                n->mark = s->shape;
+                if (s->run_count == s->run_capacity)
+                {
+                    s->run_capacity *= 2;
+                    s->runs = (Run **)
+                        realloc(s->runs, s->run_capacity * sizeof(Run *));
+                }
+                s->runs[s->run_count++] = n;
+            }
         }
+    }
+
+    *pmin_x = min_x;
+    *pmax_x = max_x;
+    *pmax_y = max_y;
+}
+
+/* Makes the gaps of the current shape and finds out which of them
+ * are outside. Returns nonzero if some are not.
+ * The shape should have two runs in some row.
+ */
+static int find_holes(Splitter *s, int32 top, int32 min_x, int32 max_x,
+                      int32 max_y)
+{
+    int32 h = max_y - top + 1;
+    int32 i, sp = 0;
 
-        /* proceed with contour */
-        if (pixels[y + dy][x + dx])  /* testing (3) */
+    for (i = 0; i < h; i++)
+    {
+        s->first[i] = INT32_MAX;
+        s->last[i] = -1;
+    }
+    for (i = 0; i < s->run_count; i++)
+    {
+        Run *r = s->runs[i];
+        int32 y = r->y - top;
+        int32 j = r - s->rows[r->y % s->window].runs;
+        if (j < s->first[y]) s->first[y] = j;
+        if (j > s->last[y]) s->last[y] = j;
+    }
+
+    s->gap_count = 0;
+    for (i = 0; i < h; i++)
+    {
+        Run *runs = s->rows[(top + i) % s->window].runs;
+        int32 x = min_x - 1; /* the left end of the current gap */
+        int border = (i == 0 || i == h - 1);
+        int32 j;
+
+        s->gap_rows[i] = s->gap_count;
+        for (j = s->first[i]; j <= s->last[i]; j++)
         {
-            int32 x4 = x + dx - dy, y4 = y + dy + dx;
+            if (runs[j].mark != s->shape) continue;
+            add_gap(s, i, x, runs[j].x0 - 1, border || x < min_x);
+            x = runs[j].x1 + 1;
+        }
+        add_gap(s, i, x, max_x + 1, 1);
+    }
+    s->gap_rows[h] = s->gap_count;
+
+    for (i = 0; i < s->gap_count; i++)
+        if (s->gaps[i].outside) s->gap_stack[sp++] = i;
 
-            if (pixels[y4][x4]) /* testing (4) */
+    while (sp)
+    {
+        Gap *g = &s->gaps[s->gap_stack[--sp]];
+        int d;
+        for (d = -1; d <= 1; d += 2)
+        {
+            int32 y = g->row + d, a, b;
+            if (y < 0 || y >= h) continue;
+            a = s->gap_rows[y];
+            b = s->gap_rows[y + 1];
+            while (a < b)
             {
-                /* (3) and (4) are black - right turn */
-                /* (-dy,dx) becomes new (dx,dy) (coordinate system is left) */
-                /* pixel (4) becomes (x,y) */
-                int32 old_dx = dx;
-                dx = -dy;
-                dy = old_dx;
-                x = x4; y = y4;
+                int32 mid = (a + b) / 2;
+                if (s->gaps[mid].x1 < g->x0 - 1) a = mid + 1; else b = mid;
             }
-            else
+            for (; a < s->gap_rows[y + 1] && s->gaps[a].x0 <= g->x1 + 1; a++)
             {
-                /* go straight: pixel (3) becomes (x,y) */
-                x += dx; y += dy;
+                if (s->gaps[a].outside) continue;
+                s->gaps[a].outside = 1;
+                s->gap_stack[sp++] = a;
             }
         }
-        else
+    }
+
+    for (i = 0; i < s->gap_count; i++)
+        if (!s->gaps[i].outside) return 1;
+    return 0;
+}
+
+/* Renders the current shape and everything inside it into a new bitmap
+ * and takes those runs away.
+ */
+static mdjvu_bitmap_t take_shape(Splitter *s, int32 top, int32 min_x,
+                                 int32 max_x, int32 max_y)
+{
+    int32 h = max_y - top + 1;
+    mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(max_x - min_x + 1, h);
+    int32 i;
+
+    /* with a single run in each row, there's no room for holes */
+    if (s->run_count == h || !find_holes(s, top, min_x, max_x, max_y))
+    {
+        for (i = 0; i < s->run_count; i++)
         {
-            /* (3) is white - left turn */
-            /* (dy,-dx) becomes new (dx,dy) (coordinate system is left) */
-            int32 old_dx = dx;
-            dx = dy;
-            dy = -old_dx;
+            Run *r = s->runs[i];
+            fill_bits(mdjvu_bitmap_access_packed_row(bitmap, r->y - top),
+                      r->x0 - min_x, r->x1 - min_x);
+            r->mark = DEAD;
         }
+        return bitmap;
     }
-    *pmin_x = min_x;
-    *pmax_x = max_x;
-    *pmin_y = start_y;
-    *pmax_y = max_y;
+
+    /* A run between two runs of the shape lies in the gap between them,
+     * since otherwise it would touch the shape.
+     */
+    for (i = 0; i < h; i++)
+    {
+        Run *runs = s->rows[(top + i) % s->window].runs;
+        unsigned char *bits = mdjvu_bitmap_access_packed_row(bitmap, i);
+        Gap *gap = &s->gaps[s->gap_rows[i]];
+        int32 j;
+
+        for (j = s->first[i]; j <= s->last[i]; j++)
+        {
+            Run *r = &runs[j];
+            if (r->mark == s->shape)
+                gap++;
+            else if (r->mark == DEAD || gap->outside)
+                continue;
+            fill_bits(bits, r->x0 - min_x, r->x1 - min_x);
+            r->mark = DEAD;
+        }
+    }
+
+    return bitmap;
+}
+
+/* ___________________________   moving the window   _______________________ */
+
+/* A shape as it was taken, before chunking. */
+typedef struct
+{
+    mdjvu_bitmap_t bitmap;
+    int32 x, y;
+} Shape;
+
+typedef struct
+{
+    Shape *shapes;  /* in the order they were taken */
+    int32 count, capacity;
+} ShapeList;
+
+static void add_shape(ShapeList *list, mdjvu_bitmap_t bitmap, int32 x, int32 y)
+{
+    Shape *shape;
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? 2 * list->capacity : 256;
+        list->shapes = (Shape *)
+            realloc(list->shapes, list->capacity * sizeof(Shape));
+    }
+    shape = &list->shapes[list->count++];
+    shape->bitmap = bitmap;
+    shape->x = x;
+    shape->y = y;
+}
+
+static void splitter_alloc(Splitter *s, int32 width, int32 height,
+                           int32 window)
+{
+    s->bitmap = NULL;
+    s->read_row = NULL;
+    s->row_buffer = NULL;
+    s->failed = 0;
+    s->width = width;
+    s->height = height;
+    s->window = window;
+    s->rows = (RunRow *) calloc(window, sizeof(RunRow));
+    s->shape = 0;
+    s->run_capacity = 256;
+    s->runs = (Run **) malloc(s->run_capacity * sizeof(Run *));
+    s->first = (int32 *) malloc(window * sizeof(int32));
+    s->last = (int32 *) malloc(window * sizeof(int32));
+    s->gaps = NULL;
+    s->gap_stack = NULL;
+    s->gap_count = s->gap_capacity = 0;
+    s->gap_rows = (int32 *) malloc((window + 1) * sizeof(int32));
+}
+
+/* Reads the y-th row into s->rows[y % window].
+ * A row that read_row() fails to give is taken as blank.
+ */
+static void load_row(Splitter *s, int32 y)
+{
+    RunRow *row = &s->rows[y % s->window];
+    const unsigned char *bits;
+
+    if (s->bitmap)
+    {
+        bits = mdjvu_bitmap_access_packed_row(s->bitmap, y);
+    }
+    else
+    {
+        if (!s->failed && !s->read_row(s->param, s->row_buffer, y))
+            s->failed = 1;
+        if (s->failed)
+            memset(s->row_buffer, 0, (s->width + 7) >> 3);
+        bits = s->row_buffer;
+    }
+
+    find_runs(row, bits, s->width, y);
+    if (s->window > 1 && y > 0)
+        link_runs(&s->rows[(y - 1) % s->window], row);
+}
+
+/* Loads rows y..y + window - 1 of the bitmap into a new splitter. */
+static void splitter_init(Splitter *s, mdjvu_bitmap_t bitmap,
+                          int32 window, int32 y)
+{
+    int32 i;
+
+    splitter_alloc(s, mdjvu_bitmap_get_width(bitmap),
+                      mdjvu_bitmap_get_height(bitmap), window);
+    s->bitmap = bitmap;
+    for (i = y; i < y + window && i < s->height; i++)
+        load_row(s, i);
+}
+
+static void splitter_free(Splitter *s)
+{
+    int32 i;
+    for (i = 0; i < s->window; i++)
+        free(s->rows[i].runs);
+    free(s->rows);
+    free(s->runs);
+    free(s->first);
+    free(s->last);
+    free(s->gaps);
+    free(s->gap_stack);
+    free(s->gap_rows);
+    free(s->row_buffer);
+}
+
+/* Takes the shapes starting in the y-th row, which should be the top one
+ * in the window, and moves the window down.
+ * Each shape sees only the window, so taller ones get cut.
+ */
+static void process_row(Splitter *s, int32 y, ShapeList *result)
+{
+    RunRow *row = &s->rows[y % s->window];
+    int32 bottom = y + s->window - 1;
+    int32 i;
+
+    if (bottom >= s->height) bottom = s->height - 1;
+
+    for (i = 0; i < row->count; i++)
+    {
+        int32 min_x, max_x, max_y;
+
+        if (row->runs[i].mark == DEAD) continue;
+
+        collect_shape(s, &row->runs[i], y, bottom, &min_x, &max_x, &max_y);
+        add_shape(result, take_shape(s, y, min_x, max_x, max_y), min_x, y);
+    }
+
+    /* The y-th row is empty now; reuse it for the next one */
+    if (y + s->window < s->height)
+        load_row(s, y + s->window);
 }
 
-/* ____________________________   process row   ____________________________ */
+/* _________________________   the main routines   _________________________ */
 
 static void add_to_image(mdjvu_image_t image,
                          mdjvu_bitmap_t bitmap,
@@ -221,74 +511,66 @@ static void add_to_image(mdjvu_image_t image,
                          int32 blit_shift_y,
                          int big);
 
-
-/* This function scans the y-th row for contours. */
-/* Margins (1 pixel) from each side are required. */
-static void process_row(unsigned char **pixels, unsigned char **map,
-                        int32 y, int32 w, int32 h,
-                        mdjvu_image_t image, int32 shift_x, int32 shift_y,
-                        int32 max_shape_width,
-                        int32 blit_shift_x, int32 blit_shift_y,
-                        int32 dpi, mdjvu_split_options_t opt,
-                        int big)
+/* Puts the shapes into the image, chunking those that are too wide. */
+static void add_shapes_to_image(mdjvu_image_t image, ShapeList *list,
+                                int32 max_shape_width,
+                                int32 dpi, mdjvu_split_options_t opt,
+                                int32 blit_shift_x, int32 blit_shift_y,
+                                int big)
 {
-    unsigned char *row = pixels[y];
     int32 i;
-    for (i = 0; i < w; i++)
+    for (i = 0; i < list->count; i++)
     {
-        if (row[i])
+        mdjvu_bitmap_t bitmap = list->shapes[i].bitmap;
+        int32 x = list->shapes[i].x, y = list->shapes[i].y;
+        int32 shape_width = mdjvu_bitmap_get_width(bitmap);
+        if (shape_width <= max_shape_width)
         {
-            int32 min_x, max_x, min_y, max_y, shape_width;
-
-            /* extract the contour */
-            mdjvu_bitmap_t bitmap;
-            walk_around_a_black_contour(pixels, map, i, y,
-                                        &min_x, &max_x, &min_y, &max_y);
-            bitmap = interpret_runs(min_x, max_x,
-                                    min_y, max_y,
-                                    map, pixels);
-            shape_width = mdjvu_bitmap_get_width(bitmap);
-            assert(shape_width == max_x - min_x + 1);
-            assert(mdjvu_bitmap_get_height(bitmap) == max_y - min_y + 1);
-            if (shape_width <= max_shape_width)
+            mdjvu_image_add_bitmap(image, bitmap);
+            mdjvu_image_add_blit(image, x + blit_shift_x,
+                                        y + blit_shift_y, bitmap);
+            mdjvu_image_set_suspiciously_big_flag(image, bitmap, big);
+        }
+        else
+        {
+            /* further split the bitmap */
+            int32 number_of_chunks = (shape_width + max_shape_width - 1)
+                                        /
+                                      max_shape_width;
+            int32 j;
+            int32 shape_height = mdjvu_bitmap_get_height(bitmap);
+            for (j = 0; j < number_of_chunks; j++)
             {
-                mdjvu_image_add_bitmap(image, bitmap);
-                mdjvu_image_add_blit(image, shift_x + min_x + blit_shift_x,
-                                            y + shift_y + blit_shift_y, bitmap);
-                mdjvu_image_set_suspiciously_big_flag(image, bitmap, big);
+                int32 chunk_x = shape_width * j / number_of_chunks;
+                mdjvu_bitmap_t chunk = mdjvu_bitmap_crop(bitmap,
+                  chunk_x, 0,
+                  shape_width * (j+1) / number_of_chunks - chunk_x,
+                  shape_height
+                );
+                /* After splitting, some white margins may be left,
+                 * or the bitmap may lose connectivity.
+                 * Apply the algorithm recursively to the chunk.
+                 */
+                add_to_image(image, chunk, dpi, opt,
+                             chunk_x + x + blit_shift_x,
+                             y + blit_shift_y, /* big: */ 1);
+                mdjvu_bitmap_destroy(chunk);
             }
-            else
-            {
-                /* further split the bitmap */
-                int32 number_of_chunks = (shape_width + max_shape_width - 1)
-                                            /
-                                          max_shape_width;
-                int32 j;
-                int32 shape_height = mdjvu_bitmap_get_height(bitmap);
-                for (j = 0; j < number_of_chunks; j++)
-                {
-                    int32 chunk_x = shape_width * j / number_of_chunks;
-                    mdjvu_bitmap_t chunk = mdjvu_bitmap_crop(bitmap,
-                      chunk_x, 0,
-                      shape_width * (j+1) / number_of_chunks - chunk_x,
-                      shape_height
-                    );
-                    /* After splitting, some white margins may be left,
-                     * or the bitmap may lose connectivity.
-                     * Apply the algorithm recursively to the chunk.
-                     */
-                    add_to_image(image, chunk, dpi, opt,
-                                 shift_x + chunk_x + min_x + blit_shift_x,
-                                 y + shift_y + blit_shift_y, /* big: */ 1);
-                    mdjvu_bitmap_destroy(chunk);
-                }
-                mdjvu_bitmap_destroy(bitmap);
-            } /* if (shape_width <= max_shape_width) */
-        }
+            mdjvu_bitmap_destroy(bitmap);
+        } /* if (shape_width <= max_shape_width) */
     }
 }
 
-/* _________________________   the main routines   _________________________ */
+static int32 get_window(int32 height, int32 dpi, mdjvu_split_options_t opt)
+{
+    int32 max_shape_size = opt ? * (int32 *) opt : 0;
+
+    if (!max_shape_size)
+        max_shape_size = dpi;
+    if (max_shape_size > height)
+        max_shape_size = height;
+    return max_shape_size;
+}
 
 /* Not much job left to do here, mostly moving a window through the image. */
 
@@ -300,100 +582,194 @@ static void add_to_image(mdjvu_image_t image,
                          int32 blit_shift_y,
                          int big)
 {
-    int32 max_shape_size = opt ? * (int32 *) opt : 0;
-    int32 width = mdjvu_bitmap_get_width(bitmap);
     int32 height = mdjvu_bitmap_get_height(bitmap);
-    unsigned char **buf, **window_base, **window_buf, **map;
-    int32 window_shift = 0, y = 0, i;
+    int32 window = get_window(height, dpi, opt);
+    ShapeList list = {NULL, 0, 0};
+    Splitter s;
+    int32 y;
 
-    if (!max_shape_size)
-        max_shape_size = dpi;
-    if (max_shape_size > height)
-        max_shape_size = height;
+    splitter_init(&s, bitmap, window, 0);
+    for (y = 0; y < height; y++)
+        process_row(&s, y, &list);
+    splitter_free(&s);
 
-    /* n-th line will be unpacked into buf[n % max_shape_size] + 1.
-     * ( +1 is to make the left margin)
-     * buf[max_shape_size] will always be blank.
-     *
-     * window_base[window_shift - 1]
-     *      points to buf[max_shape_size] + 1 (blank line) - top margin
-     * window_base[window_shift + max_shape_size]
-     *      points to buf[max_shape_size] + 1 (blank line) - bottom margin
-     * window_base[window_shift + i]
-     *      points to buf[(window_shift + i) % max_shape_size] + 1.
-     */
+    add_shapes_to_image(image, &list, window, dpi, opt,
+                        blit_shift_x, blit_shift_y, big);
+    free(list.shapes);
+}
+
+/* _____________________________   splitting bands   ________________________ */
 
-    /* map has the right margin of 1 */
-    map = mdjvu_create_2d_array(width + 1, max_shape_size);
+/* A big page is cut into horizontal bands split concurrently,
+ * each as if it was the top of the page.
+ * Then the bands are joined from the top down: a band is split anew
+ * where shapes from above could make a difference,
+ * until its own results agree for a window height.
+ * Past that point, both ways have the same pixels left,
+ * so the rest of the band can be taken as it is.
+ */
+
+#define MINIMUM_BAND_HEIGHT_IN_WINDOWS 4
 
-    /* buf has left, right and bottom margins of 1 */
-    buf = mdjvu_create_2d_array(width + 2, max_shape_size + 1);
-    window_buf = (unsigned char **)
-        malloc(2 * (max_shape_size + 2) * sizeof(unsigned char *));
-    window_base = window_buf + 1;
+static int same_shape(Shape *a, Shape *b)
+{
+    int32 w = mdjvu_bitmap_get_width(a->bitmap);
+    int32 h = mdjvu_bitmap_get_height(a->bitmap);
+    int32 row_size = mdjvu_bitmap_get_packed_row_size(a->bitmap);
+    int32 y;
 
-    /* Unpack initial portion of the bitmap; bind the window to the buffer */
-    for (i = 0; i < max_shape_size; i++)
+    if (a->x != b->x || a->y != b->y
+     || w != mdjvu_bitmap_get_width(b->bitmap)
+     || h != mdjvu_bitmap_get_height(b->bitmap))
     {
-        window_base[i] = window_base[max_shape_size + i] = buf[i] + 1;
-        mdjvu_bitmap_unpack_row(bitmap, buf[i] + 1, i);
+        return 0;
+    }
+    for (y = 0; y < h; y++)
+    {
+        if (memcmp(mdjvu_bitmap_access_packed_row(a->bitmap, y),
+                   mdjvu_bitmap_access_packed_row(b->bitmap, y), row_size))
+        {
+            return 0;
+        }
     }
+    return 1;
+}
 
-    /* Setup top and bottom white margins */
-    window_base[-1] =
-        window_base[2 * max_shape_size - 1] =
-            buf[max_shape_size] + 1;
+/* Returns the index of the first run that ends at x or to the right of it. */
+static int32 find_run(Run *runs, int32 count, int32 x)
+{
+    int32 lo = 0, hi = count;
+    while (lo < hi)
+    {
+        int32 mid = (lo + hi) / 2;
+        if (runs[mid].x1 < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    /* The "window moving" loop.
-     * We're moving a (width x max_shape_size) window through the image.
-     */
-    while(1)
+/* Takes away the runs of a shape from rows y and further.
+ * A shape consists of whole runs, so it's enough to look at one pixel of each.
+ */
+static void take_away(Splitter *s, Shape *shape, int32 y)
+{
+    int32 w = mdjvu_bitmap_get_width(shape->bitmap);
+    int32 h = mdjvu_bitmap_get_height(shape->bitmap);
+
+    for (; y < shape->y + h; y++)
     {
-        /* Extract some shapes from the window
-         * (shapes touching the topmost row will be affected).
-         */
+        RunRow *row = &s->rows[y % s->window];
+        unsigned char *bits =
+            mdjvu_bitmap_access_packed_row(shape->bitmap, y - shape->y);
+        int32 i;
+
+        for (i = find_run(row->runs, row->count, shape->x);
+             i < row->count && row->runs[i].x0 < shape->x + w; i++)
+        {
+            int32 x = row->runs[i].x0 - shape->x;
+            if (x >= 0 && (bits[x >> 3] & (0x80 >> (x & 7))))
+                row->runs[i].mark = DEAD;
+        }
+    }
+}
+
+static void destroy_shapes(ShapeList *list, int32 from, int32 to)
+{
+    int32 i;
+    for (i = from; i < to; i++)
+        mdjvu_bitmap_destroy(list->shapes[i].bitmap);
+}
+
+static void split_in_bands(ShapeList *result, mdjvu_bitmap_t bitmap,
+                           int32 window, int32 band_count)
+{
+    int32 height = mdjvu_bitmap_get_height(bitmap);
+    ShapeList *bands = (ShapeList *) calloc(band_count, sizeof(ShapeList));
+    int32 *band_top = (int32 *) malloc((band_count + 1) * sizeof(int32));
+    int32 k;
+
+    for (k = 0; k < band_count; k++)
+        band_top[k] = k * (height / band_count);
+    band_top[band_count] = height;
 
-        unsigned char *top_margin_save =    /* make the top margin */
-            window_base[window_shift - 1];  /* (save what was there) */
-        unsigned char *bot_margin_save =    /* same with the bottom margin */
-            window_base[window_shift + max_shape_size];
-        int32 old_window_shift;
-        window_base[window_shift - 1] = buf[max_shape_size] + 1; /* clear them */
-        window_base[window_shift + max_shape_size] = buf[max_shape_size] + 1;
-
-        process_row(window_base + window_shift, map,
-                    /* index of a row to process: */ 0,
-                    width, max_shape_size, image, 0, y, max_shape_size,
-                    blit_shift_x, blit_shift_y, dpi, opt, big);
-
-        window_base[window_shift - 1] = top_margin_save; /* restore margins */
-        window_base[window_shift + max_shape_size] = bot_margin_save;
-
-        /* Shift the window */
-        y++;
-        old_window_shift = window_shift;
-        window_shift = y % max_shape_size;
-        if (y + max_shape_size > height)
-            break;
-
-        /* Unpack a new row into the bottom window row */
-        mdjvu_bitmap_unpack_row(bitmap, buf[old_window_shift] + 1,
-                                        y + max_shape_size - 1);
+    #pragma omp parallel for schedule(dynamic)
+    for (k = 0; k < band_count; k++)
+    {
+        Splitter s;
+        int32 y;
+        splitter_init(&s, bitmap, window, band_top[k]);
+        for (y = band_top[k]; y < band_top[k + 1]; y++)
+            process_row(&s, y, &bands[k]);
+        splitter_free(&s);
     }
 
-    /* Process the last window fully */
-    for (i = 0; y + i < height; i++)
+    *result = bands[0];
+    for (k = 1; k < band_count; k++)
     {
-        process_row(window_base + window_shift, map,
-                    /* index of a row to process: */ i,
-                    width, max_shape_size, image, 0, y, max_shape_size,
-                    blit_shift_x, blit_shift_y, dpi, opt, big);
+        ShapeList *band = &bands[k];
+        int32 top = band_top[k], bottom = band_top[k + 1];
+        int32 last_mismatch = top - 1;
+        int32 i = 0, j, y;
+        Splitter s;
+
+        /* restore the state left by the shapes above */
+        splitter_init(&s, bitmap, window, top);
+        for (j = result->count - 1;
+             j >= 0 && result->shapes[j].y > top - window; j--)
+        {
+            take_away(&s, &result->shapes[j], top);
+        }
+
+        for (y = top; y < bottom && y < last_mismatch + window; y++)
+        {
+            int32 start = result->count, n = 0;
+
+            process_row(&s, y, result);
+
+            /* compare with the shapes of the band starting in this row */
+            while (i + n < band->count && band->shapes[i + n].y == y) n++;
+            if (n != result->count - start)
+                last_mismatch = y;
+            else for (j = 0; j < n; j++)
+            {
+                if (!same_shape(&result->shapes[start + j], &band->shapes[i + j]))
+                {
+                    last_mismatch = y;
+                    break;
+                }
+            }
+            i += n;
+        }
+        splitter_free(&s);
+
+        /* The shapes from row y on are the same in both ways */
+        destroy_shapes(band, 0, i);
+        for (; i < band->count; i++)
+        {
+            Shape *shape = &band->shapes[i];
+            add_shape(result, shape->bitmap, shape->x, shape->y);
+        }
+        free(band->shapes);
     }
 
-    /* Clean up */
-    free(window_buf);
-    mdjvu_destroy_2d_array(map);
-    mdjvu_destroy_2d_array(buf);
+    free(band_top);
+    free(bands);
+}
+
+static int32 get_band_count(int32 height, int32 window)
+{
+#ifdef _OPENMP
+    int32 n;
+    if (!window || omp_in_parallel()) return 1;
+    n = height / (MINIMUM_BAND_HEIGHT_IN_WINDOWS * window);
+    if (n > omp_get_max_threads()) n = omp_get_max_threads();
+    return n > 1 ? n : 1;
+#else
+    (void) height; (void) window;
+    return 1;
+#endif
 }
 
 mdjvu_image_t
@@ -401,9 +777,105 @@ mdjvu_split(mdjvu_bitmap_t bitmap, int32 dpi, mdjvu_split_options_t opt)
 {
     int32 width = mdjvu_bitmap_get_width(bitmap);
     int32 height = mdjvu_bitmap_get_height(bitmap);
+    int32 window = get_window(height, dpi, opt);
+    int32 band_count = get_band_count(height, window);
     mdjvu_image_t result = mdjvu_image_create(width, height);
     mdjvu_image_enable_suspiciously_big_flags(result);
     mdjvu_image_set_resolution(result, dpi);
-    add_to_image(result, bitmap, dpi, opt, 0, 0, /* big: */ 0);
+
+    if (band_count > 1)
+    {
+        ShapeList list;
+        split_in_bands(&list, bitmap, window, band_count);
+        add_shapes_to_image(result, &list, window, dpi, opt,
+                            0, 0, /* big: */ 0);
+        free(list.shapes);
+    }
+    else
+    {
+        add_to_image(result, bitmap, dpi, opt, 0, 0, /* big: */ 0);
+    }
+    return result;
+}
+
+mdjvu_image_t
+mdjvu_split_rows(int32 width, int32 height, int32 dpi,
+                 mdjvu_split_options_t opt,
+                 int (*read_row)(void *param, unsigned char *row, int32 y),
+                 void *param)
+{
+    int32 window = get_window(height, dpi, opt);
+    ShapeList list = {NULL, 0, 0};
+    mdjvu_image_t result;
+    Splitter s;
+    int32 y;
+
+    splitter_alloc(&s, width, height, window);
+    s.read_row = read_row;
+    s.param = param;
+    s.row_buffer = (unsigned char *) malloc((width + 7) >> 3);
+    for (y = 0; y < window; y++)
+        load_row(&s, y);
+    for (y = 0; y < height && !s.failed; y++)
+        process_row(&s, y, &list);
+    splitter_free(&s);
+
+    if (s.failed)
+    {
+        destroy_shapes(&list, 0, list.count);
+        free(list.shapes);
+        return NULL;
+    }
+
+    result = mdjvu_image_create(width, height);
+    mdjvu_image_enable_suspiciously_big_flags(result);
+    mdjvu_image_set_resolution(result, dpi);
+    add_shapes_to_image(result, &list, window, dpi, opt, 0, 0, /* big: */ 0);
+    free(list.shapes);
+    return result;
+}
+
+mdjvu_image_t
+mdjvu_split_image(mdjvu_image_t image, int32 dpi, mdjvu_split_options_t opt)
+{
+    int32 max_shape_size = opt ? * (int32 *) opt : 0;
+    int marked = mdjvu_image_has_suspiciously_big_flags(image);
+    int32 b = mdjvu_image_get_blit_count(image), i;
+    mdjvu_image_t result = mdjvu_image_create(mdjvu_image_get_width(image),
+                                              mdjvu_image_get_height(image));
+    mdjvu_image_enable_suspiciously_big_flags(result);
+    mdjvu_image_set_resolution(result, dpi);
+
+    if (!max_shape_size)
+        max_shape_size = dpi;
+
+    for (i = 0; i < b; i++)
+    {
+        mdjvu_bitmap_t bitmap = mdjvu_image_get_blit_bitmap(image, i);
+        int32 x = mdjvu_image_get_blit_x(image, i);
+        int32 y = mdjvu_image_get_blit_y(image, i);
+        int32 w = mdjvu_bitmap_get_width(bitmap);
+        int32 h = mdjvu_bitmap_get_height(bitmap);
+        int own = mdjvu_image_has_bitmap(image, bitmap);
+
+        if (!w || !h) continue;
+
+        /* Non-symbol data may hold anything, and shapes that are too big
+         * would be cut by mdjvu_split(), so these go through the splitter.
+         */
+        if ((own && marked && mdjvu_image_get_suspiciously_big_flag(image, bitmap))
+         || w > max_shape_size || h > max_shape_size)
+        {
+            add_to_image(result, bitmap, dpi, opt, x, y, /* big: */ 0);
+        }
+        else
+        {
+            /* like mdjvu_split(), give each blit a bitmap of its own */
+            mdjvu_bitmap_t copy = mdjvu_bitmap_clone(bitmap);
+            mdjvu_image_add_bitmap(result, copy);
+            mdjvu_image_add_blit(result, x, y, copy);
+        }
+    }
+
     return result;
 }
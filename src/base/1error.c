@@ -34,6 +34,10 @@ MDJVU_IMPLEMENT mdjvu_error_t mdjvu_get_error(MinidjvuErrorType e)
             return (mdjvu_error_t) _("unsupported type of DjVu file");
         case mdjvu_error_djvu_no_Sjbz:
             return (mdjvu_error_t) _("bilevel data not found in DjVu file");
+        case mdjvu_error_djvu_no_dictionary:
+            return (mdjvu_error_t) _("shared dictionary not found in DjVu file");
+        case mdjvu_error_djvu_no_page:
+            return (mdjvu_error_t) _("no such page in DjVu file");
         case mdjvu_error_recursive_prototypes:
             return (mdjvu_error_t) _("somehow prototype references recursed");
         case mdjvu_error_tiff_support_disabled:
@@ -2,9 +2,23 @@
  * 2io.c - a stdio wrapper
  */
 
+/* open_memstream() is POSIX.1-2008; this must precede any system header. */
+#ifndef _POSIX_C_SOURCE
+    #define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "../base/mdjvucfg.h"
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#ifdef HAVE_MMAP
+    #include <sys/types.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
 
 MDJVU_IMPLEMENT mdjvu_file_t mdjvu_fopen(const char *path, const char *mode)
     { return (mdjvu_file_t) fopen(path, mode); }
@@ -86,3 +100,192 @@ MDJVU_IMPLEMENT int16 mdjvu_read_little_endian_int16(mdjvu_file_t file)
     r |= getc(f) << 8;
     return r;
 }
+
+/* Memory files {{{ */
+
+struct MinidjvuMemoryFile
+{
+    FILE *file;
+    char *buffer;
+    size_t length;
+};
+
+MDJVU_IMPLEMENT mdjvu_memory_file_t mdjvu_memory_file_create(void)
+{
+    struct MinidjvuMemoryFile *m = MDJVU_MALLOC(struct MinidjvuMemoryFile);
+    if (!m) return NULL;
+    m->buffer = NULL;
+    m->length = 0;
+    #ifdef HAVE_OPEN_MEMSTREAM
+        m->file = open_memstream(&m->buffer, &m->length);
+    #else
+        /* no memory streams here (Windows): spool through a temporary file */
+        m->file = tmpfile();
+    #endif
+    if (!m->file)
+    {
+        MDJVU_FREE(m);
+        return NULL;
+    }
+    return (mdjvu_memory_file_t) m;
+}
+
+MDJVU_IMPLEMENT mdjvu_file_t mdjvu_memory_file_get_file(mdjvu_memory_file_t m)
+{
+    return (mdjvu_file_t) ((struct MinidjvuMemoryFile *) m)->file;
+}
+
+MDJVU_IMPLEMENT void *mdjvu_memory_file_close(mdjvu_memory_file_t mf, int32 *plength)
+{
+    struct MinidjvuMemoryFile *m = (struct MinidjvuMemoryFile *) mf;
+    char *result;
+    int ok;
+
+    #ifdef HAVE_OPEN_MEMSTREAM
+        ok = !fclose(m->file);
+        result = m->buffer;
+    #else
+        long length;
+        ok = !fflush(m->file) && !fseek(m->file, 0, SEEK_END)
+          && (length = ftell(m->file)) >= 0;
+        result = NULL;
+        if (ok)
+        {
+            m->length = (size_t) length;
+            result = MDJVU_MALLOCV(char, m->length + 1);
+            rewind(m->file);
+            ok = result && fread(result, 1, m->length, m->file) == m->length;
+        }
+        fclose(m->file);
+    #endif
+
+    if (!ok || m->length > INT32_MAX)
+    {
+        MDJVU_FREEV(result);
+        result = NULL;
+        m->length = 0;
+    }
+    if (plength) *plength = (int32) m->length;
+    MDJVU_FREE(m);
+    return result;
+}
+
+MDJVU_IMPLEMENT int mdjvu_memory_file_finish(mdjvu_memory_file_t m, int result,
+    void **pbuffer, int32 *plength, mdjvu_error_t *perr)
+{
+    int32 length = 0;
+    void *buffer = m ? mdjvu_memory_file_close(m, &length) : NULL;
+
+    if (!m || (result && !buffer))
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        result = 0;
+    }
+    if (!result)
+    {
+        free(buffer);
+        buffer = NULL;
+        length = 0;
+    }
+    *pbuffer = buffer;
+    if (plength) *plength = length;
+    return result ? 1 : 0;
+}
+
+/* }}} */
+
+/* Mapped files {{{ */
+
+struct MinidjvuMappedFile
+{
+    void *data;
+    size_t size;
+    int mapped; /* 1 - munmap() it, 0 - free() it */
+};
+
+/* The fallback: just read the whole file. */
+static int read_whole_file(const char *path, struct MinidjvuMappedFile *m)
+{
+    long size;
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0)
+    {
+        fclose(f);
+        return 0;
+    }
+    rewind(f);
+    m->size = (size_t) size;
+    m->data = malloc(m->size ? m->size : 1);
+    if (!m->data || fread(m->data, 1, m->size, f) != m->size)
+    {
+        free(m->data);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    m->mapped = 0;
+    return 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_mapped_file_t mdjvu_map_file(const char *path)
+{
+    struct MinidjvuMappedFile *m = MDJVU_MALLOC(struct MinidjvuMappedFile);
+    if (!m) return NULL;
+
+    #ifdef HAVE_MMAP
+    {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            MDJVU_FREE(m);
+            return NULL;
+        }
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0
+         && st.st_size == (off_t) (size_t) st.st_size)
+        {
+            m->size = (size_t) st.st_size;
+            m->data = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m->data != MAP_FAILED)
+            {
+                close(fd);
+                m->mapped = 1;
+                return (mdjvu_mapped_file_t) m;
+            }
+        }
+        close(fd);
+    }
+    #endif
+
+    if (!read_whole_file(path, m))
+    {
+        MDJVU_FREE(m);
+        return NULL;
+    }
+    return (mdjvu_mapped_file_t) m;
+}
+
+MDJVU_IMPLEMENT const void *mdjvu_mapped_file_get_data(mdjvu_mapped_file_t m)
+{
+    return ((struct MinidjvuMappedFile *) m)->data;
+}
+
+MDJVU_IMPLEMENT size_t mdjvu_mapped_file_get_size(mdjvu_mapped_file_t m)
+{
+    return ((struct MinidjvuMappedFile *) m)->size;
+}
+
+MDJVU_IMPLEMENT void mdjvu_unmap_file(mdjvu_mapped_file_t mf)
+{
+    struct MinidjvuMappedFile *m = (struct MinidjvuMappedFile *) mf;
+    #ifdef HAVE_MMAP
+        if (m->mapped)
+            munmap(m->data, m->size);
+        else
+    #endif
+            free(m->data);
+    MDJVU_FREE(m);
+}
+
+/* }}} */
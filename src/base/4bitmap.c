@@ -139,6 +139,32 @@ MDJVU_IMPLEMENT void mdjvu_bitmap_clear(mdjvu_bitmap_t b)
     memset(BMP->data[0], 0, BMP->height * ROW_SIZE);
 }
 
+MDJVU_IMPLEMENT void mdjvu_bitmap_clear_padding(mdjvu_bitmap_t b)
+{
+    int32 i;
+    unsigned char mask = (unsigned char) ~(0xFF >> (BMP->width & 7));
+    if (!(BMP->width & 7)) return;
+    for (i = 0; i < BMP->height; i++)
+        BMP->data[i][ROW_SIZE - 1] &= mask;
+}
+
+MDJVU_IMPLEMENT void mdjvu_bitmap_invert(mdjvu_bitmap_t b)
+{
+    /* rows are contiguous, so the whole bitmap is done a word at a time */
+    unsigned char *p = BMP->data[0];
+    size_t n = (size_t) BMP->height * ROW_SIZE, i;
+    for (i = 0; i + sizeof(size_t) <= n; i += sizeof(size_t))
+    {
+        size_t word;
+        memcpy(&word, p + i, sizeof(size_t));
+        word = ~word;
+        memcpy(p + i, &word, sizeof(size_t));
+    }
+    for (; i < n; i++)
+        p[i] = (unsigned char) ~p[i];
+    mdjvu_bitmap_clear_padding(b);
+}
+
 /* __________________________   packing/unpacking   ________________________ */
 
 /* All the functions in this part are, well, suboptimized. */
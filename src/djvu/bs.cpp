@@ -953,3 +953,264 @@ void BSEncoder::write32(unsigned int card)
 
 
 
+
+// ========================================
+// -- Decoding
+
+static int decode_raw(ZPDecoder &zp, int bits)
+{
+    int n = 1;
+    const int m = (1<<bits);
+    while (n < m)
+    {
+        const int b = zp.decode_without_context();
+        n = (n<<1) | b;
+    }
+    return n - m;
+}
+
+static int decode_binary(ZPDecoder &zp, ZPBitContext *ctx, int bits)
+{
+    // Require 2^bits-1    contexts
+    int n = 1;
+    int m = (1<<bits);
+    ctx = ctx - 1;
+    while (n < m)
+    {
+        int b = zp.decode(ctx[n]);
+        n = (n<<1) | b;
+    }
+    return n - m;
+}
+
+int BSDecoder::decode()
+{
+    /////////////////////////////////
+    ////////////    Decode input stream
+
+    ZPDecoder &zp = gzp;
+    int i;
+    // Decode block size
+    size = decode_raw(zp, 24);
+    if (!size)
+        return 0;
+    if (size > MAXBLOCK*1024)
+    {
+        error = true;
+        return 0;
+    }
+    // Allocate
+    if (blocksize < (unsigned int) size)
+    {
+        blocksize = size;
+        free(data);
+        data = NULL;
+    }
+    if (!data)
+        data = (unsigned char *) malloc(blocksize);
+    // Decode Estimation Speed
+    int fshift = 0;
+    if (zp.decode_without_context())
+    {
+        fshift += 1;
+        if (zp.decode_without_context())
+            fshift += 1;
+    }
+    // Prepare Quasi MTF
+    unsigned char mtf[256];
+    unsigned int    freq[FREQMAX];
+    int m;
+    for (m=0; m<256; m++)
+        mtf[m] = m;
+    for (m=0; m<FREQMAX; m++)
+        freq[m] = 0;
+    int fadd = 4;
+    // Decode
+    int mtfno = 3;
+    int markerpos = -1;
+    for (i=0; i<size; i++)
+    {
+        int ctxid = CTXIDS-1;
+        if (ctxid>mtfno) ctxid=mtfno;
+        ZPBitContext *cx = ctx;
+        if (zp.decode(cx[ctxid]))
+            { mtfno=0; data[i]=mtf[mtfno]; goto rotate; }
+        cx+=CTXIDS;
+        if (zp.decode(cx[ctxid]))
+            { mtfno=1; data[i]=mtf[mtfno]; goto rotate; }
+        cx+=CTXIDS;
+        if (zp.decode(cx[0]))
+            { mtfno=2+decode_binary(zp,cx+1,1); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+1;
+        if (zp.decode(cx[0]))
+            { mtfno=4+decode_binary(zp,cx+1,2); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+3;
+        if (zp.decode(cx[0]))
+            { mtfno=8+decode_binary(zp,cx+1,3); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+7;
+        if (zp.decode(cx[0]))
+            { mtfno=16+decode_binary(zp,cx+1,4); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+15;
+        if (zp.decode(cx[0]))
+            { mtfno=32+decode_binary(zp,cx+1,5); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+31;
+        if (zp.decode(cx[0]))
+            { mtfno=64+decode_binary(zp,cx+1,6); data[i]=mtf[mtfno]; goto rotate; }
+        cx+=1+63;
+        if (zp.decode(cx[0]))
+            { mtfno=128+decode_binary(zp,cx+1,7); data[i]=mtf[mtfno]; goto rotate; }
+        mtfno=256;
+        data[i]=0;
+        markerpos=i;
+        continue;
+        // Rotate MTF according to empirical frequencies (new!)
+    rotate:
+        // Adjust frequencies for overflow
+        fadd = fadd + (fadd>>fshift);
+        if (fadd > 0x10000000)
+        {
+            fadd = fadd>>24;
+            freq[0] >>= 24;
+            freq[1] >>= 24;
+            freq[2] >>= 24;
+            freq[3] >>= 24;
+            for (int k=4; k<FREQMAX; k++)
+                freq[k] = freq[k]>>24;
+        }
+        // Relocate new char according to new freq
+        unsigned int fc = fadd;
+        if (mtfno < FREQMAX)
+            fc += freq[mtfno];
+        int k;
+        for (k=mtfno; k>=FREQMAX; k--)
+            mtf[k] = mtf[k-1];
+        for (; k>0 && fc>=freq[k-1]; k--)
+        {
+            mtf[k] = mtf[k-1];
+            freq[k] = freq[k-1];
+        }
+        mtf[k] = data[i];
+        freq[k] = fc;
+    }
+
+    /////////////////////////////////
+    ////////// Reconstruct the string
+
+    if (markerpos<1 || markerpos>=size)
+    {
+        error = true;
+        return 0;
+    }
+    // Allocate pointers
+    unsigned int *posn = (unsigned int *) calloc(size, sizeof(unsigned int));
+    // Prepare count buffer
+    int count[256];
+    for (i=0; i<256; i++)
+        count[i] = 0;
+    // Fill count buffer
+    for (i=0; i<markerpos; i++)
+    {
+        unsigned char c = data[i];
+        posn[i] = (c<<24) | (count[c] & 0xffffff);
+        count[c] += 1;
+    }
+    for (i=markerpos+1; i<size; i++)
+    {
+        unsigned char c = data[i];
+        posn[i] = (c<<24) | (count[c] & 0xffffff);
+        count[c] += 1;
+    }
+    // Compute sorted char positions
+    int last = 1;
+    for (i=0; i<256; i++)
+    {
+        int tmp = count[i];
+        count[i] = last;
+        last += tmp;
+    }
+    // Undo the sort transform
+    i = 0;
+    last = size-1;
+    while (last>0)
+    {
+        unsigned int n = posn[i];
+        unsigned char c = (posn[i]>>24);
+        data[--last] = c;
+        i = count[c] + (n & 0xffffff);
+        if (i >= size)
+            break;
+    }
+    free(posn);
+    // Check
+    if (last || i != markerpos)
+    {
+        error = true;
+        return 0;
+    }
+    return size;
+}
+
+BSDecoder::BSDecoder(const unsigned char *chunk, int32 length)
+        : eof(false), error(false), bptr(0), blocksize(0), size(0),
+          data(NULL), gzp(chunk, length)
+{
+    // ctx[] is cleared by the ZPBitContext constructor
+}
+
+BSDecoder::~BSDecoder()
+{
+    free(data);
+}
+
+size_t BSDecoder::read(void *buffer, size_t sz)
+{
+    size_t copied = 0;
+    while (sz > 0 && !eof)
+    {
+        // Decode next block when needed
+        if (bptr >= size - 1)
+        {
+            bptr = 0;
+            // the last byte of a block is the marker
+            if (!decode())
+            {
+                eof = true;
+                break;
+            }
+        }
+        // Compute remaining
+        int bytes = size - 1 - bptr;
+        if (bytes > (int) sz)
+            bytes = sz;
+        memcpy(buffer, data + bptr, bytes);
+        buffer = (void *) ((char *) buffer + bytes);
+        bptr += bytes;
+        sz -= bytes;
+        copied += bytes;
+    }
+    return copied;
+}
+
+int BSDecoder::read8(uint32 &card)
+{
+    unsigned char c[1];
+    if (read(c, sizeof(c)) != sizeof(c)) return 0;
+    card = c[0];
+    return 1;
+}
+
+int BSDecoder::read16(uint32 &card)
+{
+    unsigned char c[2];
+    if (read(c, sizeof(c)) != sizeof(c)) return 0;
+    card = (c[0]<<8) | c[1];
+    return 1;
+}
+
+int BSDecoder::read24(uint32 &card)
+{
+    unsigned char c[3];
+    if (read(c, sizeof(c)) != sizeof(c)) return 0;
+    card = (c[0]<<16) | (c[1]<<8) | c[2];
+    return 1;
+}
@@ -37,3 +37,31 @@ class BSEncoder
         ZPBitContext ctx[300];
 };
 
+
+class BSDecoder
+{
+    public:
+        BSDecoder(const unsigned char *data, int32 length); // does not copy it
+        ~BSDecoder();
+
+        // returns the number of bytes read, less than sz only at the end
+        size_t read(void *buffer, size_t sz);
+        int read8 (uint32 &card);
+        int read16(uint32 &card);
+        int read24(uint32 &card);
+        bool corrupted(void) const { return error; }
+
+    private:
+        int decode(void);
+
+        // Data
+        bool            eof, error;
+        int             bptr;
+        unsigned int    blocksize;
+        int             size;
+        unsigned char  *data;
+
+        // Coder
+        ZPDecoder gzp;
+        ZPBitContext ctx[300];
+};
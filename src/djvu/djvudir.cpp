@@ -10,10 +10,34 @@
 #include <string.h>
 #include <ctype.h>
 
+// Encodes the BZZ-compressed part of DIRM: sizes, flags and IDs.
+static void write_dirm_components(BSEncoder &bse, char **elements, int *sizes, int n)
+{
+    int i, flag;
+
+    for (i=0; i<n; i++)
+        bse.write24(sizes[i]);
+
+    // Encode DJVU flags (the only bit meaningful in our context indicates
+    // if this is a DJVU page (1) or a shared file (0))
+    for (i=0; i<n; i++)
+    {
+        flag = mdjvu_ends_with_ignore_case(elements[i],".djvu") ? 1 : 0;
+        bse.write8(flag);
+    }
+
+    // Encode file IDs (no names, no titles)
+    for (i=0; i<n; i++)
+    {
+        bse.write(elements[i],strlen(elements[i]));
+        bse.write8(0);
+    }
+}
+
 MDJVU_IMPLEMENT void mdjvu_write_dirm_bundled(char **elements, int * sizes, 
     int n, mdjvu_file_t f, mdjvu_error_t *perr)
 {
-    int i, flag, offpos, end, off, *offsets;
+    int i, offpos, end, off, *offsets;
     
     // version number and the DJVU bundled flag
     fputc(1 | ((1)<<7), (FILE *) f);
@@ -27,33 +51,17 @@ MDJVU_IMPLEMENT void mdjvu_write_dirm_bundled(char **elements, int * sizes,
     {
         mdjvu_write_big_endian_int32((uint32) 0, f);
     }
-    
+
+    // Calculate offsets
+    for (i=1; i<n; i++) 
     {
-        BSEncoder bse((FILE *) f);
-        // Encode file sizes and calculate offsets
-        bse.write24(sizes[0]);
-        for (i=1; i<n; i++) 
-        {
-            offsets[i] = offsets[i-1] + sizes[i-1];
-            if (sizes[i-1] & 1) offsets[i]++;
-            bse.write24(sizes[i]);
-        }
-        
-        // Encode DJVU flags (the only bit meaningful in our context indicates
-        // if this is a DJVU page (1) or a shared file (0))
-        for (i=0; i<n; i++)
-        {
-            flag = mdjvu_ends_with_ignore_case(elements[i],".djvu") ? 1 : 0;
-            bse.write8(flag);
-        }
-    
-        // Encode file IDs (no names, no titles)
-        for (i=0; i<n; i++)
-        {
-            bse.write(elements[i],strlen(elements[i]));
-            bse.write8(0);
-        }
+        offsets[i] = offsets[i-1] + sizes[i-1];
+        if (sizes[i-1] & 1) offsets[i]++;
+    }
 
+    {
+        BSEncoder bse((FILE *) f);
+        write_dirm_components(bse, elements, sizes, n);
         // Close BZZ encoder
     }
     end = off = ftell((FILE *) f);
@@ -68,10 +76,26 @@ MDJVU_IMPLEMENT void mdjvu_write_dirm_bundled(char **elements, int * sizes,
     fseek((FILE *) f, end, SEEK_SET);
 }
 
+MDJVU_IMPLEMENT void mdjvu_write_dirm_bundled_with_offsets(char **elements,
+    int *sizes, int *offsets, int n, mdjvu_file_t f, mdjvu_error_t *perr)
+{
+    int i;
+
+    // version number and the DJVU bundled flag
+    fputc(1 | ((1)<<7), (FILE *) f);
+    // Number of files
+    mdjvu_write_big_endian_int16((uint16) n, f);
+
+    for (i=0; i<n; i++)
+        mdjvu_write_big_endian_int32((uint32) offsets[i], f);
+
+    BSEncoder bse((FILE *) f);
+    write_dirm_components(bse, elements, sizes, n);
+}
+
 MDJVU_IMPLEMENT void mdjvu_write_dirm_indirect(char **elements, int * sizes, 
     int n, mdjvu_file_t f, mdjvu_error_t *perr)
 {
-    int i, flag;
     BSEncoder bse((FILE *) f);
     
     // version number
@@ -79,24 +103,118 @@ MDJVU_IMPLEMENT void mdjvu_write_dirm_indirect(char **elements, int * sizes,
     // Number of files
     mdjvu_write_big_endian_int16((uint16) n, f);
     
-    // Encode file sizes
-    for (i=0; i<n; i++) 
-        bse.write24(sizes[i]);
-        
-    // Encode DJVU flags (the only bit meaningful in our context indicates
-    // if this is a DJVU page (1) or a shared file (0))
-    for (i=0; i<n; i++)
+    write_dirm_components(bse, elements, sizes, n);
+}
+
+// Reads a zero-terminated string from the BZZ stream into a malloc()ed buffer.
+static char *read_dirm_string(BSDecoder &bsd)
+{
+    int32 length = 0, allocated = 32;
+    char *s = (char *) malloc(allocated);
+    uint32 c;
+
+    while (bsd.read8(c))
     {
-        flag = mdjvu_ends_with_ignore_case(elements[i],".djvu") ? 1 : 0;
-        bse.write8(flag);
+        if (length == allocated)
+        {
+            allocated <<= 1;
+            s = (char *) realloc(s, allocated);
+        }
+        s[length++] = (char) c;
+        if (!c) return s;
     }
+    free(s);
+    return NULL;
+}
 
-    // Encode file IDs (no names, no titles)
-    for (i=0; i<n; i++)
+MDJVU_IMPLEMENT int mdjvu_memory_read_dirm_bundled(const void *chunk, int32 length,
+    int32 *pn, int32 **poffsets, unsigned char **pflags, char ***pids, mdjvu_error_t *perr)
+{
+    const unsigned char *p = (const unsigned char *) chunk;
+    int32 i, n;
+    uint32 size;
+
+    if (perr) *perr = NULL;
+    if (length < 3)
     {
-        bse.write(elements[i],strlen(elements[i]));
-        bse.write8(0);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+    // only bundled documents keep the components in the same file
+    if (!(p[0] & 0x80))
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_wrong_djvu_type);
+        return 0;
+    }
+    n = (p[1] << 8) | p[2];
+    if (length < 3 + 4 * n)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+
+    int32 *offsets = (int32 *) malloc((n + 1) * sizeof(int32));
+    unsigned char *flags = (unsigned char *) malloc(n + 1);
+    char **ids = (char **) calloc(n + 1, sizeof(char *));
+    p += 3;
+    for (i = 0; i < n; i++, p += 4)
+    {
+        offsets[i] = (int32) (((uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+    }
+
+    BSDecoder bsd(p, length - 3 - 4 * n);
+    bool ok = true;
+
+    // sizes are redundant in bundled documents: each FORM knows its length
+    for (i = 0; i < n && ok; i++)
+        ok = bsd.read24(size) != 0;
+
+    for (i = 0; i < n && ok; i++)
+    {
+        uint32 c;
+        ok = bsd.read8(c) != 0;
+        flags[i] = (unsigned char) c;
+    }
+
+    // file IDs, then optional names and titles (flag bits 7 and 6)
+    for (i = 0; i < n && ok; i++)
+    {
+        ids[i] = read_dirm_string(bsd);
+        ok = ids[i] != NULL;
+        if (ok && (flags[i] & 0x80))
+        {
+            char *name = read_dirm_string(bsd);
+            ok = name != NULL;
+            free(name);
+        }
+        if (ok && (flags[i] & 0x40))
+        {
+            char *title = read_dirm_string(bsd);
+            ok = title != NULL;
+            free(title);
+        }
+    }
+
+    if (!ok || bsd.corrupted())
+    {
+        mdjvu_free_dirm(offsets, flags, ids, n);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
     }
-}
 
+    *pn = n;
+    *poffsets = offsets;
+    *pflags = flags;
+    *pids = ids;
+    return 1;
+}
 
+MDJVU_IMPLEMENT void mdjvu_free_dirm(int32 *offsets, unsigned char *flags, char **ids, int32 n)
+{
+    int32 i;
+    for (i = 0; i < n; i++)
+        free(ids[i]);
+    free(ids);
+    free(flags);
+    free(offsets);
+}
@@ -1,11 +1,15 @@
 /*
- * djvuload.c - functions to load from single-page DjVuBitonal files
+ * djvuload.c - functions to load from DjVuBitonal files
  */
 
 #include "../base/mdjvucfg.h"
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 static uint32 read_uint32_most_significant_byte_first(FILE *f)
 {
@@ -66,6 +70,11 @@ static int find_sibling_chunk(FILE *file, IFFChunk *chunk, uint32 id)
 #define CHUNK_ID_FORM     0x464F524D
 #define ID_DJVU           0x444A5655
 #define CHUNK_ID_Sjbz     0x536A627A
+#define ID_DJVM           0x444A564D
+#define ID_DJVI           0x444A5649
+#define CHUNK_ID_DIRM     0x4449524D
+#define CHUNK_ID_INCL     0x494E434C
+#define CHUNK_ID_Djbz     0x446A627A
 
 MDJVU_IMPLEMENT int mdjvu_locate_jb2_chunk(mdjvu_file_t file, int32 *plength, mdjvu_error_t *perr)
 {
@@ -114,18 +123,486 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_djvu_page(mdjvu_file_t file, mdjvu
     return mdjvu_file_load_jb2(file, length, perr);
 }
 
+/* In-memory parsing {{{ */
+
+static uint32 get_uint32_most_significant_byte_first(const unsigned char *p)
+{
+    return ((uint32) p[0] << 24) | ((uint32) p[1] << 16)
+         | ((uint32) p[2] << 8) | p[3];
+}
+
+/* Looks for a chunk with the given id among the chunks in [*ppos, end).
+ * On success, *ppos is the start of the chunk data and *plength its length.
+ */
+static int find_chunk_in_memory(const unsigned char *buf, size_t *ppos, size_t end,
+                                uint32 id, uint32 *plength)
+{
+    size_t pos = *ppos;
+    while (end - pos >= 8)
+    {
+        uint32 chunk_id = get_uint32_most_significant_byte_first(buf + pos);
+        uint32 length = get_uint32_most_significant_byte_first(buf + pos + 4);
+        pos += 8;
+        if (length > end - pos)
+            return 0;
+        if (chunk_id == id)
+        {
+            *ppos = pos;
+            *plength = length;
+            return 1;
+        }
+        pos += length;
+        if (pos < end) pos += length & 1;
+    }
+    return 0;
+}
+
+MDJVU_IMPLEMENT int mdjvu_memory_locate_jb2_chunk(const void *buffer, size_t size,
+    const void **pchunk, int32 *plength, mdjvu_error_t *perr)
+{
+    const unsigned char *buf = (const unsigned char *) buffer;
+    size_t pos = 0, end;
+    uint32 length;
+    if (perr) *perr = NULL;
+
+    /* "AT&T" is optional, as in DjVuLibre */
+    if (size >= 4 && get_uint32_most_significant_byte_first(buf) == CHUNK_ID_AT_AND_T)
+        pos = 4;
+
+    if (!find_chunk_in_memory(buf, &pos, size, CHUNK_ID_FORM, &length) || length < 4)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return 0;
+    }
+    if (get_uint32_most_significant_byte_first(buf + pos) != ID_DJVU)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_wrong_djvu_type);
+        return 0;
+    }
+    end = pos + length;
+    pos += 4;
+
+    if (!find_chunk_in_memory(buf, &pos, end, CHUNK_ID_Sjbz, &length)
+     || length > INT32_MAX)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_djvu_no_Sjbz);
+        return 0;
+    }
+
+    *pchunk = buf + pos;
+    *plength = (int32) length;
+    return 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_memory_load_djvu_page(const void *buffer, size_t size, mdjvu_error_t *perr)
+{
+    const void *chunk;
+    int32 length;
+    if (!mdjvu_memory_locate_jb2_chunk(buffer, size, &chunk, &length, perr))
+        return NULL;
+    return mdjvu_memory_load_jb2(chunk, length, perr);
+}
+
+/* }}} */
+
+/* Multipage documents {{{ */
+
+#ifdef _OPENMP
+    #define LOCK_TYPE       omp_lock_t
+    #define LOCK_INIT(l)    omp_init_lock(l)
+    #define LOCK_DESTROY(l) omp_destroy_lock(l)
+    #define LOCK(l)         omp_set_lock(l)
+    #define UNLOCK(l)       omp_unset_lock(l)
+#else
+    #define LOCK_TYPE       char
+    #define LOCK_INIT(l)    ((void) (l))
+    #define LOCK_DESTROY(l) ((void) (l))
+    #define LOCK(l)         ((void) (l))
+    #define UNLOCK(l)       ((void) (l))
+#endif
+
+#define DEFAULT_DICTIONARY_LIMIT 4
+
+/* A shared dictionary, decoded when some page needs it.
+ * Loaded pages hold references; unreferenced dictionaries stay resident
+ * until there are more of them than the document's limit,
+ * then the least recently used ones go.
+ */
+typedef struct
+{
+    mdjvu_image_t image;
+    int32 references;
+    uint32 last_use;
+    LOCK_TYPE loading; /* held while decoding this dictionary */
+} Dictionary;
+
+struct MinidjvuDocument
+{
+    mdjvu_mapped_file_t mapping; /* NULL if the buffer belongs to the caller */
+    const unsigned char *data;
+    size_t size;
+
+    int32 components_count;
+    int32 *offsets;              /* of FORM chunks */
+    unsigned char *flags;
+    char **ids;
+
+    int32 pages_count;
+    int32 *pages;                /* component index of each page */
+
+    /* the fields below are guarded by `lock' */
+    Dictionary *dictionaries;    /* one per component */
+    int32 resident;              /* decoded dictionaries */
+    int32 limit;
+    uint32 clock;
+    LOCK_TYPE lock;
+};
+
+/* Finds the FORM of the given type that starts exactly at `offset'.
+ * On success, [*pbegin, *pend) are its chunks.
+ */
+static int get_form(mdjvu_document_t doc, int32 offset, uint32 type,
+                    size_t *pbegin, size_t *pend)
+{
+    size_t pos = (size_t) offset;
+    uint32 length;
+
+    if (offset < 0 || pos > doc->size
+     || !find_chunk_in_memory(doc->data, &pos, doc->size, CHUNK_ID_FORM, &length)
+     || pos != (size_t) offset + 8 || length < 4
+     || get_uint32_most_significant_byte_first(doc->data + pos) != type)
+    {
+        return 0;
+    }
+    *pbegin = pos + 4;
+    *pend = pos + length;
+    return 1;
+}
+
+static int32 find_component(mdjvu_document_t doc, const unsigned char *id, uint32 length)
+{
+    int32 i;
+    for (i = 0; i < doc->components_count; i++)
+    {
+        const char *s = doc->ids[i];
+        if (s && strlen(s) == length && !memcmp(s, id, length))
+            return i;
+    }
+    return -1;
+}
+
+/* Destroys least recently used unreferenced dictionaries
+ * while there are too many of them. Call under doc->lock.
+ */
+static void evict_dictionaries(mdjvu_document_t doc)
+{
+    while (doc->resident > doc->limit)
+    {
+        Dictionary *victim = NULL;
+        int32 i;
+        for (i = 0; i < doc->components_count; i++)
+        {
+            Dictionary *d = &doc->dictionaries[i];
+            if (d->image && !d->references
+             && (!victim || d->last_use < victim->last_use))
+            {
+                victim = d;
+            }
+        }
+        if (!victim) return; /* all are in use */
+        mdjvu_image_destroy(victim->image);
+        victim->image = NULL;
+        doc->resident--;
+    }
+}
+
+static mdjvu_image_t decode_dictionary(mdjvu_document_t doc, int32 component, mdjvu_error_t *perr)
+{
+    mdjvu_image_t dict;
+    size_t pos, end;
+    uint32 length;
+    int32 i, n;
+
+    if (!get_form(doc, doc->offsets[component], ID_DJVI, &pos, &end)
+     || !find_chunk_in_memory(doc->data, &pos, end, CHUNK_ID_Djbz, &length)
+     || length > INT32_MAX)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_djvu_no_dictionary);
+        return NULL;
+    }
+
+    dict = mdjvu_memory_load_jb2(doc->data + pos, (int32) length, perr);
+    if (!dict) return NULL;
+
+    /* all shapes of a dictionary go to the library in the order of decoding */
+    n = mdjvu_image_get_bitmap_count(dict);
+    mdjvu_image_enable_dictionary_indices(dict);
+    for (i = 0; i < n; i++)
+        mdjvu_image_set_dictionary_index(dict, mdjvu_image_get_bitmap(dict, i), i);
+
+    return dict;
+}
+
+/* Returns the dictionary with a new reference, decoding it if necessary.
+ * Pages that need different dictionaries don't wait for each other.
+ */
+static mdjvu_image_t acquire_dictionary(mdjvu_document_t doc, int32 component, mdjvu_error_t *perr)
+{
+    Dictionary *d = &doc->dictionaries[component];
+    mdjvu_image_t dict;
+
+    LOCK(&d->loading);
+
+    LOCK(&doc->lock);
+    dict = d->image;
+    if (dict)
+    {
+        d->references++;
+        d->last_use = doc->clock++;
+    }
+    UNLOCK(&doc->lock);
+
+    if (!dict)
+    {
+        dict = decode_dictionary(doc, component, perr);
+        if (dict)
+        {
+            LOCK(&doc->lock);
+            d->image = dict;
+            d->references = 1;
+            d->last_use = doc->clock++;
+            doc->resident++;
+            evict_dictionaries(doc);
+            UNLOCK(&doc->lock);
+        }
+    }
+
+    UNLOCK(&d->loading);
+    return dict;
+}
+
+static void release_dictionary(mdjvu_document_t doc, mdjvu_image_t dict)
+{
+    int32 i;
+    LOCK(&doc->lock);
+    for (i = 0; i < doc->components_count; i++)
+    {
+        Dictionary *d = &doc->dictionaries[i];
+        if (d->image == dict)
+        {
+            d->references--;
+            evict_dictionaries(doc);
+            break;
+        }
+    }
+    UNLOCK(&doc->lock);
+}
+
+MDJVU_IMPLEMENT mdjvu_document_t mdjvu_memory_open_djvu_document(const void *buffer, size_t size,
+                                                                 mdjvu_error_t *perr)
+{
+    const unsigned char *buf = (const unsigned char *) buffer;
+    mdjvu_document_t doc;
+    size_t pos = 0, end;
+    uint32 length, type;
+    int32 i;
+    if (perr) *perr = NULL;
+
+    if (size >= 4 && get_uint32_most_significant_byte_first(buf) == CHUNK_ID_AT_AND_T)
+        pos = 4;
+
+    if (!find_chunk_in_memory(buf, &pos, size, CHUNK_ID_FORM, &length) || length < 4)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return NULL;
+    }
+    type = get_uint32_most_significant_byte_first(buf + pos);
+    end = pos + length;
+
+    doc = (mdjvu_document_t) calloc(1, sizeof(struct MinidjvuDocument));
+    doc->data = buf;
+    doc->size = size;
+
+    if (type == ID_DJVU)
+    {
+        /* the file itself is the only component */
+        doc->components_count = 1;
+        doc->offsets = (int32 *) malloc(sizeof(int32));
+        doc->offsets[0] = (int32) (pos - 8);
+        doc->flags = (unsigned char *) malloc(1);
+        doc->flags[0] = 1;
+        doc->ids = (char **) calloc(1, sizeof(char *));
+    }
+    else if (type == ID_DJVM)
+    {
+        pos += 4;
+        if (!find_chunk_in_memory(buf, &pos, end, CHUNK_ID_DIRM, &length) || length > INT32_MAX)
+        {
+            free(doc);
+            if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+            return NULL;
+        }
+        if (!mdjvu_memory_read_dirm_bundled(buf + pos, (int32) length, &doc->components_count,
+                                            &doc->offsets, &doc->flags, &doc->ids, perr))
+        {
+            free(doc);
+            return NULL;
+        }
+    }
+    else
+    {
+        free(doc);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_wrong_djvu_type);
+        return NULL;
+    }
+
+    doc->dictionaries = (Dictionary *) calloc(doc->components_count + 1, sizeof(Dictionary));
+    for (i = 0; i < doc->components_count; i++)
+        LOCK_INIT(&doc->dictionaries[i].loading);
+    doc->limit = DEFAULT_DICTIONARY_LIMIT;
+    LOCK_INIT(&doc->lock);
+    doc->pages = (int32 *) malloc((doc->components_count + 1) * sizeof(int32));
+    for (i = 0; i < doc->components_count; i++)
+    {
+        if ((doc->flags[i] & 0x3F) == 1)
+            doc->pages[doc->pages_count++] = i;
+    }
+
+    return doc;
+}
+
+MDJVU_IMPLEMENT mdjvu_document_t mdjvu_open_djvu_document(const char *path, mdjvu_error_t *perr)
+{
+    mdjvu_document_t doc;
+    mdjvu_mapped_file_t m = mdjvu_map_file(path);
+    if (perr) *perr = NULL;
+    if (!m)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+    doc = mdjvu_memory_open_djvu_document(mdjvu_mapped_file_get_data(m),
+                                          mdjvu_mapped_file_get_size(m), perr);
+    if (!doc)
+    {
+        mdjvu_unmap_file(m);
+        return NULL;
+    }
+    doc->mapping = m;
+    return doc;
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_document_get_page_count(mdjvu_document_t doc)
+{
+    return doc->pages_count;
+}
+
+MDJVU_IMPLEMENT void mdjvu_document_set_dictionary_limit(mdjvu_document_t doc, int32 limit)
+{
+    LOCK(&doc->lock);
+    doc->limit = limit;
+    evict_dictionaries(doc);
+    UNLOCK(&doc->lock);
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_document_load_page(mdjvu_document_t doc, int32 page, mdjvu_error_t *perr)
+{
+    mdjvu_image_t dict = NULL, result;
+    size_t pos, end, incl;
+    uint32 length;
+    if (perr) *perr = NULL;
+
+    if (page < 0 || page >= doc->pages_count)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_djvu_no_page);
+        return NULL;
+    }
+    if (!get_form(doc, doc->offsets[doc->pages[page]], ID_DJVU, &pos, &end))
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_djvu);
+        return NULL;
+    }
+
+    /* A page may include other shared files (annotations, for instance),
+     * so take the first one that has a dictionary.
+     */
+    incl = pos;
+    while (!dict && find_chunk_in_memory(doc->data, &incl, end, CHUNK_ID_INCL, &length))
+    {
+        int32 k = find_component(doc, doc->data + incl, length);
+        if (k >= 0)
+        {
+            mdjvu_error_t error = NULL;
+            dict = acquire_dictionary(doc, k, &error);
+            if (!dict && error != mdjvu_get_error(mdjvu_error_djvu_no_dictionary))
+            {
+                /* a broken dictionary, not just a file without one */
+                if (perr) *perr = error ? error : mdjvu_get_error(mdjvu_error_corrupted_djvu);
+                return NULL;
+            }
+        }
+        incl += length;
+        if (incl < end) incl += length & 1;
+    }
+
+    if (!find_chunk_in_memory(doc->data, &pos, end, CHUNK_ID_Sjbz, &length)
+     || length > INT32_MAX)
+    {
+        if (dict) release_dictionary(doc, dict);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_djvu_no_Sjbz);
+        return NULL;
+    }
+
+    result = mdjvu_memory_load_jb2_with_dictionary(doc->data + pos, (int32) length, dict, perr);
+
+    /* A page that needs no shapes from the dictionary doesn't keep it,
+     * so mdjvu_document_unload_page() won't find it to give it back.
+     */
+    if (dict && (!result || mdjvu_image_get_dictionary(result) != dict))
+        release_dictionary(doc, dict);
+    return result;
+}
+
+MDJVU_IMPLEMENT void mdjvu_document_unload_page(mdjvu_document_t doc, mdjvu_image_t page)
+{
+    mdjvu_image_t dict = mdjvu_image_get_dictionary(page);
+    mdjvu_image_destroy(page);
+    if (dict) release_dictionary(doc, dict);
+}
+
+MDJVU_IMPLEMENT void mdjvu_close_djvu_document(mdjvu_document_t doc)
+{
+    int32 i;
+    for (i = 0; i < doc->components_count; i++)
+    {
+        if (doc->dictionaries[i].image)
+            mdjvu_image_destroy(doc->dictionaries[i].image);
+        LOCK_DESTROY(&doc->dictionaries[i].loading);
+    }
+    LOCK_DESTROY(&doc->lock);
+    free(doc->dictionaries);
+    free(doc->pages);
+    mdjvu_free_dirm(doc->offsets, doc->flags, doc->ids, doc->components_count);
+    if (doc->mapping)
+        mdjvu_unmap_file(doc->mapping);
+    free(doc);
+}
+
+/* }}} */
+
 MDJVU_IMPLEMENT mdjvu_image_t mdjvu_load_djvu_page(const char *path, mdjvu_error_t *perr)
 {
     mdjvu_image_t result;
-    FILE *f = fopen(path, "rb");
+    mdjvu_mapped_file_t m = mdjvu_map_file(path);
     if (perr) *perr = NULL;
-    if (!f)
+    if (!m)
     {
         if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
         return NULL;
     }
-    result = mdjvu_file_load_djvu_page((mdjvu_file_t) f, perr);
-    fclose(f);
+    result = mdjvu_memory_load_djvu_page(mdjvu_mapped_file_get_data(m),
+                                         mdjvu_mapped_file_get_size(m), perr);
+    mdjvu_unmap_file(m);
     return result;
 }
 
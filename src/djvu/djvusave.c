@@ -2,11 +2,84 @@
  * djvusave.c - saving DjVuBitonal pages
  */
 
+/* copy_file_range() is a GNU extension; this must precede any system header. */
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
 #include "../base/mdjvucfg.h"
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+    #include <sys/types.h>
+    #include <unistd.h>
+#endif
+#ifdef HAVE_SENDFILE
+    #include <sys/sendfile.h>
+#endif
+
+enum {copy_buffer_size = 1 << 16};
+
+/* Appends the first `length' bytes of `src' to `dst'.
+ * Where the kernel can copy between files, the data don't pass
+ * through user space at all; otherwise they're copied in big blocks.
+ * Returns 0 on I/O error.
+ */
+static int append_file_contents(FILE *dst, FILE *src, long length)
+{
+    char *buffer;
+    long done = 0;
+
+    if (fflush(src) || fflush(dst)) return 0;
+
+    #if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+    {
+        int in = fileno(src), out = fileno(dst);
+        off_t offset = 0;
+        ssize_t r = -1;
+
+        #ifdef HAVE_COPY_FILE_RANGE
+            while (done < length
+                && (r = copy_file_range(in, &offset, out, NULL, length - done, 0)) > 0)
+                done += r;
+        #endif
+        #ifdef HAVE_SENDFILE
+            /* copy_file_range() may refuse (old kernels, cross-device copies) */
+            if (r < 0)
+            {
+                while (done < length
+                    && (r = sendfile(out, in, &offset, length - done)) > 0)
+                    done += r;
+            }
+        #endif
+
+        /* we've been writing past the stdio stream, resynchronize it */
+        if (fseek(dst, 0, SEEK_END)) return 0;
+        if (done == length) return 1;
+        if (fseek(src, done, SEEK_SET)) return 0;
+    }
+    #else
+        rewind(src);
+    #endif
+
+    buffer = MDJVU_MALLOCV(char, copy_buffer_size);
+    if (!buffer) return 0;
+    while (done < length)
+    {
+        size_t chunk = length - done < copy_buffer_size ?
+                       (size_t) (length - done) : copy_buffer_size;
+        if (fread(buffer, 1, chunk, src) != chunk
+         || fwrite(buffer, 1, chunk, dst) != chunk)
+            break;
+        done += chunk;
+    }
+    MDJVU_FREEV(buffer);
+    return done == length;
+}
 
 MDJVU_IMPLEMENT int mdjvu_files_save_djvu_dir(char **elements, int *sizes,
     int n, mdjvu_file_t file, mdjvu_file_t* tempfiles, int num_tempfiles, mdjvu_error_t *perr)
@@ -26,18 +99,15 @@ MDJVU_IMPLEMENT int mdjvu_files_save_djvu_dir(char **elements, int *sizes,
 
 
         for (int j = 0; j < num_tempfiles; j++) {
-            int i, fpos, tpos;
             FILE * tempfile = (FILE *) tempfiles[j];
-            tpos = ftell(tempfile);
-            fpos = ftell((FILE *) file);
+            long tpos = ftell(tempfile);
 
-            if (fpos & 1) fputc('\0', (FILE *) file);
-            rewind(tempfile);
+            if (ftell((FILE *) file) & 1) fputc('\0', (FILE *) file);
 
-            for( i=0; i<tpos; i++)
+            if (tpos < 0 || !append_file_contents((FILE *) file, tempfile, tpos))
             {
-                char ch = fgetc(tempfile);
-                fputc(ch, (FILE *) file);
+                if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+                return 0;
             }
         }
 
@@ -108,6 +178,218 @@ MDJVU_IMPLEMENT int mdjvu_file_save_djvu_dictionary(mdjvu_image_t image,
     return pos;
 }
 
+/* Streaming bundle writer {{{ */
+
+struct MinidjvuBundleWriter
+{
+    FILE *file;
+    char **elements;
+    int n, count;      /* components total and appended so far */
+    int *sizes;
+    int *offsets;      /* absolute positions of components */
+    long dirm_start;   /* position of DIRM data */
+    long dirm_length;  /* DIRM data length reserved */
+    mdjvu_iff_t FORM;
+};
+
+/* Enough for the directory unless BZZ expands the data a lot. */
+static long estimate_dirm_length(char **elements, int n)
+{
+    long raw = 4L * n;  /* sizes and flags */
+    int i;
+    for (i = 0; i < n; i++)
+        raw += strlen(elements[i]) + 1;
+    return (3 + 4L * n + raw + raw / 4 + 64) & ~1L;
+}
+
+static int write_filler(FILE *f, long length)
+{
+    while (length--)
+        if (fputc(0xFF, f) == EOF) return 0;
+    return 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_bundle_writer_t mdjvu_bundle_writer_create(char **elements, int n, mdjvu_file_t file)
+{
+    struct MinidjvuBundleWriter *w = MDJVU_MALLOC(struct MinidjvuBundleWriter);
+    mdjvu_iff_t DIRM;
+
+    w->file = (FILE *) file;
+    w->elements = elements;
+    w->n = n;
+    w->count = 0;
+    w->sizes = MDJVU_MALLOCV(int, n);
+    w->offsets = MDJVU_MALLOCV(int, n);
+    w->dirm_length = estimate_dirm_length(elements, n);
+
+    mdjvu_write_big_endian_int32(MDJVU_IFF_ID("AT&T"), file);
+    w->FORM = mdjvu_iff_write_chunk(MDJVU_IFF_ID("FORM"), file);
+        mdjvu_write_big_endian_int32(MDJVU_IFF_ID("DJVM"), file);
+
+        DIRM = mdjvu_iff_write_chunk(MDJVU_IFF_ID("DIRM"), file);
+            w->dirm_start = ftell(w->file);
+            write_filler(w->file, w->dirm_length);
+        mdjvu_iff_close_chunk(DIRM, file);
+
+    return (mdjvu_bundle_writer_t) w;
+}
+
+MDJVU_IMPLEMENT int mdjvu_bundle_writer_append(mdjvu_bundle_writer_t writer,
+    const void *data, int32 size, mdjvu_error_t *perr)
+{
+    struct MinidjvuBundleWriter *w = (struct MinidjvuBundleWriter *) writer;
+    long pos = ftell(w->file);
+
+    assert(w->count < w->n);
+    if (perr) *perr = NULL;
+    if (pos & 1)
+    {
+        fputc('\0', w->file);
+        pos++;
+    }
+    w->offsets[w->count] = pos;
+    w->sizes[w->count] = size;
+    w->count++;
+    if (fwrite(data, 1, size, w->file) != (size_t) size)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return 0;
+    }
+    return 1;
+}
+
+/* Moves everything past the DIRM data `delta' bytes further. */
+static int grow_dirm(struct MinidjvuBundleWriter *w, long delta)
+{
+    long from = w->dirm_start + w->dirm_length;
+    long pos, end;
+    char *buffer = MDJVU_MALLOCV(char, copy_buffer_size);
+    int i;
+
+    if (!buffer || fseek(w->file, 0, SEEK_END) || (end = ftell(w->file)) < 0)
+    {
+        MDJVU_FREEV(buffer);
+        return 0;
+    }
+    for (pos = end; pos > from;)
+    {
+        size_t chunk = pos - from < copy_buffer_size ?
+                       (size_t) (pos - from) : copy_buffer_size;
+        pos -= chunk;
+        if (fseek(w->file, pos, SEEK_SET)
+         || fread(buffer, 1, chunk, w->file) != chunk
+         || fseek(w->file, pos + delta, SEEK_SET)
+         || fwrite(buffer, 1, chunk, w->file) != chunk)
+        {
+            MDJVU_FREEV(buffer);
+            return 0;
+        }
+    }
+    MDJVU_FREEV(buffer);
+
+    for (i = 0; i < w->count; i++)
+        w->offsets[i] += delta;
+    w->dirm_length += delta;
+
+    /* patch the DIRM length */
+    fseek(w->file, w->dirm_start - 4, SEEK_SET);
+    mdjvu_write_big_endian_int32(w->dirm_length, (mdjvu_file_t) w->file);
+    return 1;
+}
+
+MDJVU_IMPLEMENT int mdjvu_bundle_writer_close(mdjvu_bundle_writer_t writer, mdjvu_error_t *perr)
+{
+    struct MinidjvuBundleWriter *w = (struct MinidjvuBundleWriter *) writer;
+    mdjvu_memory_file_t m;
+    void *dirm = NULL;
+    int32 length = 0;
+    long end = ftell(w->file);
+    int ok = w->count == w->n;
+
+    if (perr) *perr = NULL;
+
+    /* Offsets are in the uncompressed part of DIRM,
+     * so its length does not depend on them.
+     */
+    m = mdjvu_memory_file_create();
+    if (ok && m)
+    {
+        mdjvu_write_dirm_bundled_with_offsets(w->elements, w->sizes, w->offsets, w->n,
+                                              mdjvu_memory_file_get_file(m), perr);
+        dirm = mdjvu_memory_file_close(m, &length);
+        ok = dirm != NULL;
+    }
+    else if (m)
+        free(mdjvu_memory_file_close(m, NULL));
+    else
+        ok = 0;
+
+    if (ok && length > w->dirm_length)
+    {
+        ok = grow_dirm(w, (length - w->dirm_length + 1) & ~1L)
+          && !fseek(w->file, 0, SEEK_END);
+        end = ftell(w->file);
+        free(dirm);
+        dirm = NULL;
+        if (ok && (m = mdjvu_memory_file_create()) != NULL)
+        {
+            mdjvu_write_dirm_bundled_with_offsets(w->elements, w->sizes, w->offsets, w->n,
+                                                  mdjvu_memory_file_get_file(m), perr);
+            dirm = mdjvu_memory_file_close(m, &length);
+        }
+        ok = dirm != NULL;
+    }
+
+    /* the rest of the reserved space is 0xFF,
+     * just what the ZP decoder assumes past the end of data
+     */
+    if (ok)
+    {
+        ok = !fseek(w->file, w->dirm_start, SEEK_SET)
+          && fwrite(dirm, 1, length, w->file) == (size_t) length
+          && write_filler(w->file, w->dirm_length - length)
+          && !fseek(w->file, end, SEEK_SET);
+    }
+
+    mdjvu_iff_close_chunk(w->FORM, (mdjvu_file_t) w->file);
+
+    if (!ok && perr) *perr = mdjvu_get_error(mdjvu_error_io);
+    free(dirm);
+    MDJVU_FREEV(w->sizes);
+    MDJVU_FREEV(w->offsets);
+    MDJVU_FREE(w);
+    return ok;
+}
+
+/* }}} */
+
+/* Memory targets {{{ */
+
+MDJVU_IMPLEMENT int mdjvu_memory_save_djvu_page(mdjvu_image_t image,
+    const char *dict_name, int indirect, void **pbuffer, int32 *plength,
+    mdjvu_error_t *perr, int erosion)
+{
+    mdjvu_memory_file_t m = mdjvu_memory_file_create();
+    if (perr) *perr = NULL;
+    return mdjvu_memory_file_finish(m,
+        m && mdjvu_file_save_djvu_page(image, mdjvu_memory_file_get_file(m),
+                                       dict_name, indirect, perr, erosion),
+        pbuffer, plength, perr);
+}
+
+MDJVU_IMPLEMENT int mdjvu_memory_save_djvu_dictionary(mdjvu_image_t image,
+    int indirect, void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion)
+{
+    mdjvu_memory_file_t m = mdjvu_memory_file_create();
+    if (perr) *perr = NULL;
+    return mdjvu_memory_file_finish(m,
+        m && mdjvu_file_save_djvu_dictionary(image, mdjvu_memory_file_get_file(m),
+                                             indirect, perr, erosion),
+        pbuffer, plength, perr);
+}
+
+/* }}} */
+
 MDJVU_IMPLEMENT int mdjvu_save_djvu_dir(char **elements, int *sizes, int n, const char *path, mdjvu_error_t *perr)
 {
     int result;
@@ -25,81 +25,82 @@ typedef struct {
    uint32 color_1;                    /* Color of 1 bits             */
 } Header;
 
-/* Reads are little-endian. */
+/* Reads and writes are little-endian. */
 
-static uint32 read_uint32(FILE *f)
+#define BMP_HEADER_SIZE 62 /* size of all auxiliary info in monochrome BMP */
+
+static uint32 get_uint32(const unsigned char *p)
 {
-    uint32 r = fgetc(f);
-    r |= fgetc(f) << 8;
-    r |= fgetc(f) << 16;
-    return r | fgetc(f) << 24;;
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32) p[3] << 24;
 }
 
-static uint16 read_uint16(FILE *f)
+static uint16 get_uint16(const unsigned char *p)
 {
-    uint32 r = fgetc(f);
-    return (uint16) (r | (fgetc(f) << 8));
+    return (uint16) (p[0] | p[1] << 8);
 }
 
-static void write_uint16(FILE *f, uint16 i)
+static void put_uint16(unsigned char *p, uint16 i)
 {
-    fputc(i, f);
-    fputc(i >> 8, f);
+    p[0] = (unsigned char) i;
+    p[1] = (unsigned char) (i >> 8);
 }
 
-static void write_uint32(FILE *f, uint32 i)
+static void put_uint32(unsigned char *p, uint32 i)
 {
-    fputc(i, f);
-    fputc(i >> 8, f);
-    fputc(i >> 16, f);
-    fputc(i >> 24, f);
+    p[0] = (unsigned char) i;
+    p[1] = (unsigned char) (i >> 8);
+    p[2] = (unsigned char) (i >> 16);
+    p[3] = (unsigned char) (i >> 24);
 }
 
 static void write_bmp_header(FILE *f, uint32 w, uint32 h, int resolution)
 {
     /* Didn't use structures here for portability (concerning endianness) */
+    unsigned char header[BMP_HEADER_SIZE];
     uint32 row_size = ((w + 31) & ~31) >> 3; /* padding to 32 bit boundary */
     uint32 data_size = row_size * h;
-    uint32 data_offset = 62; /* size of all auxiliary info in monochrome BMP */
+    uint32 data_offset = BMP_HEADER_SIZE;
     uint32 dpm = resolution * 5000 / 127; /* per inch -> per meter */
-    fputc('B', f);
-    fputc('M', f);
-    write_uint32(f, data_size + data_offset); /* file size */
-    write_uint32(f, 0); /* reserved */
-    write_uint32(f, data_offset);
-    write_uint32(f, 40); /* size of the rest of header */
-    write_uint32(f, w);
-    write_uint32(f, h);
-    write_uint16(f, 1); /* number of color planes */
-    write_uint16(f, 1); /* number of bits per pixel */
-    write_uint32(f, 0); /* compression flag */
-    write_uint32(f, data_size); /* data size (0 also possible here) */
-    write_uint32(f, dpm);
-    write_uint32(f, dpm);
-    write_uint32(f, 2);
-    write_uint32(f, 0);
-    write_uint32(f, 0); /* black color */
-    write_uint32(f, 0xFFFFFF); /* white color */
+    header[0] = 'B';
+    header[1] = 'M';
+    put_uint32(header + 2, data_size + data_offset); /* file size */
+    put_uint32(header + 6, 0); /* reserved */
+    put_uint32(header + 10, data_offset);
+    put_uint32(header + 14, 40); /* size of the rest of header */
+    put_uint32(header + 18, w);
+    put_uint32(header + 22, h);
+    put_uint16(header + 26, 1); /* number of color planes */
+    put_uint16(header + 28, 1); /* number of bits per pixel */
+    put_uint32(header + 30, 0); /* compression flag */
+    put_uint32(header + 34, data_size); /* data size (0 also possible here) */
+    put_uint32(header + 38, dpm);
+    put_uint32(header + 42, dpm);
+    put_uint32(header + 46, 2);
+    put_uint32(header + 50, 0);
+    put_uint32(header + 54, 0); /* black color */
+    put_uint32(header + 58, 0xFFFFFF); /* white color */
+    fwrite(header, BMP_HEADER_SIZE, 1, f);
 }
 
-static void read_bmp_header(FILE *f, Header *h)
+/* `p' points right after "BM" */
+static void read_bmp_header(const unsigned char *p, Header *h)
 {
-    h->file_size        = read_uint32(f);
-    h->reserved         = read_uint32(f);
-    h->offset           = read_uint32(f);
-    h->size             = read_uint32(f);
-    h->width            = read_uint32(f);
-    h->height           = read_uint32(f);
-    h->planes           = read_uint16(f);
-    h->bits             = read_uint16(f);
-    h->compression      = read_uint32(f);
-    h->imagesize        = read_uint32(f);
-    h->xresolution      = read_uint32(f);
-    h->yresolution      = read_uint32(f);
-    h->ncolors          = read_uint32(f);
-    h->importantcolors  = read_uint32(f);
-    h->color_0          = read_uint32(f);
-    h->color_1          = read_uint32(f);
+    h->file_size        = get_uint32(p);
+    h->reserved         = get_uint32(p + 4);
+    h->offset           = get_uint32(p + 8);
+    h->size             = get_uint32(p + 12);
+    h->width            = get_uint32(p + 16);
+    h->height           = get_uint32(p + 20);
+    h->planes           = get_uint16(p + 24);
+    h->bits             = get_uint16(p + 26);
+    h->compression      = get_uint32(p + 28);
+    h->imagesize        = get_uint32(p + 32);
+    h->xresolution      = get_uint32(p + 36);
+    h->yresolution      = get_uint32(p + 40);
+    h->ncolors          = get_uint32(p + 44);
+    h->importantcolors  = get_uint32(p + 48);
+    h->color_0          = get_uint32(p + 52);
+    h->color_1          = get_uint32(p + 56);
 }
 
 static void save_DIB_bytes(mdjvu_bitmap_t bmp, FILE *f)
@@ -127,12 +128,10 @@ static void save_DIB_bytes(mdjvu_bitmap_t bmp, FILE *f)
             *p = ~*p; /* BMP stores pixels inversely (0 - black, 1 - white) */
         }
 
-        if (bytes_per_row > 1)
-        {
-            fwrite(buf, 1, bytes_per_row - 1, f);
-        }
-        fputc(buf[bytes_per_row - 1] & mask, f);
-        for (j = DIB_row_size - bytes_per_row; j; j--) fputc(0, f);
+        /* the padding is written zeroed along with the row */
+        buf[bytes_per_row - 1] &= mask;
+        memset(buf + bytes_per_row, 0, DIB_row_size - bytes_per_row);
+        fwrite(buf, DIB_row_size, 1, f);
     }
     free(buf);
 }
@@ -167,84 +166,130 @@ MDJVU_IMPLEMENT int mdjvu_save_bmp(mdjvu_bitmap_t bmp,
     return result;
 }
 
-static void invert_row(unsigned char *row, int32 bytes_per_row, int32 w)
-{
-    int32 i;
-    for (i = 0; i < bytes_per_row; i++)
-        row[i] = ~row[i];
-
-    /* Clear margin bits */
-    if (w & 7)
-        row[bytes_per_row - 1] &= ~(0xFF >> (w & 7));
-}
-
 #define CHECK(X) \
 { \
     if (!(X)) \
     { \
         if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_bmp); \
-        return NULL; \
+        return 0; \
     } \
 }
 #define FFs 0xFFFFFF
-MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t file, mdjvu_error_t *perr)
+
+/* Checks the header (BMP_HEADER_SIZE bytes); returns 1 - success, 0 - failure.
+ * The bitmap isn't created here: the caller first makes sure its rows exist.
+ */
+static int read_header(const unsigned char *p, int32 *width, int32 *height,
+                       int *invert, mdjvu_error_t *perr)
 {
-    FILE *f = (FILE *) file;
-    mdjvu_bitmap_t result;
-    int32 w, h, y;
-    int32 DIB_row_size, bytes_per_row;
-    int invert;
     Header header;
 
-    if (perr) *perr = NULL;
-
-    CHECK(fgetc(f)=='B');
-    CHECK(fgetc(f)=='M');
-    read_bmp_header(f, &header);
+    CHECK(p[0]=='B');
+    CHECK(p[1]=='M');
+    read_bmp_header(p + 2, &header);
     CHECK(header.compression == 0);
     CHECK(header.planes == 1);
     CHECK(header.bits == 1);
     CHECK(((header.color_0 & FFs) == 0 && (header.color_1 & FFs) == FFs) ||
           ((header.color_1 & FFs) == 0 && (header.color_0 & FFs) == FFs ));
+    CHECK(header.width && header.width <= INT32_MAX - 31
+       && header.height && header.height <= INT32_MAX);
+
+    *width = (int32) header.width;
+    *height = (int32) header.height;
+    *invert = (header.color_0 & FFs) == 0;
+    return 1;
+}
+
+/* Rows of DIB data go bottom-up; BMP and mdjvu colors are opposite,
+ * unless the palette says otherwise.
+ */
+static void load_DIB_bytes(mdjvu_bitmap_t result, const unsigned char *data, int invert)
+{
+    int32 w = mdjvu_bitmap_get_width(result);
+    int32 h = mdjvu_bitmap_get_height(result);
+    int32 DIB_row_size = ((w + 31) & ~31) >> 3; /* padding to 32 bit */
+    int32 bytes_per_row = mdjvu_bitmap_get_packed_row_size(result);
+    int32 y;
+
+    for (y = h; y; y--, data += DIB_row_size)
+        memcpy(mdjvu_bitmap_access_packed_row(result, y - 1), data, bytes_per_row);
+
+    if (invert)
+        mdjvu_bitmap_invert(result);
+    else
+        mdjvu_bitmap_clear_padding(result);
+}
 
-    invert = (header.color_0 & FFs) == 0;
-    w = header.width;
-    h = header.height;
-    result = mdjvu_bitmap_create(w, h);
-    DIB_row_size = ((w + 31) & ~31) >> 3; /* padding to 32 bit */
-    bytes_per_row = mdjvu_bitmap_get_packed_row_size(result);
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_bmp(mdjvu_file_t file, mdjvu_error_t *perr)
+{
+    FILE *f = (FILE *) file;
+    unsigned char header[BMP_HEADER_SIZE];
+    unsigned char *data;
+    mdjvu_bitmap_t result;
+    size_t row_size;
+    int32 width, height;
+    int invert;
 
-    for (y = h; y; y--)
+    if (perr) *perr = NULL;
+
+    CHECK(fread(header, BMP_HEADER_SIZE, 1, f) == 1);
+    if (!read_header(header, &width, &height, &invert, perr)) return NULL;
+
+    /* read the rows before allocating the bitmap for them */
+    row_size = (size_t) ((width + 31) >> 5 << 2);
+    data = NULL;
+    if ((size_t) -1 / row_size >= (size_t) height)
+        data = (unsigned char *) malloc(row_size * height);
+    if (!data || fread(data, row_size * height, 1, f) != 1)
     {
-        unsigned char *row = mdjvu_bitmap_access_packed_row(result, y - 1);
-        int k;
-        if (fread(row, bytes_per_row, 1, f) != 1)
-        {
-            if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
-            return NULL;
-        }
+        free(data);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return NULL;
+    }
 
-        for (k = 0; k < DIB_row_size - bytes_per_row; k++)
-            fgetc(f);
+    result = mdjvu_bitmap_create(width, height);
+    load_DIB_bytes(result, data, invert);
+    free(data);
+    return result;
+}
 
-        if (invert)
-            invert_row(row, bytes_per_row, w);
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_memory_load_bmp(const void *buffer, size_t size, mdjvu_error_t *perr)
+{
+    const unsigned char *p = (const unsigned char *) buffer;
+    mdjvu_bitmap_t result;
+    int32 width, height;
+    int invert;
+
+    if (perr) *perr = NULL;
+
+    CHECK(size >= BMP_HEADER_SIZE);
+    if (!read_header(p, &width, &height, &invert, perr)) return NULL;
+
+    /* all rows must be there before the bitmap is allocated */
+    if ((size - BMP_HEADER_SIZE) / ((width + 31) >> 5 << 2) < (size_t) height)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return NULL;
     }
 
+    result = mdjvu_bitmap_create(width, height);
+    load_DIB_bytes(result, p + BMP_HEADER_SIZE, invert);
     return result;
 }
 
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_bmp(const char *path, mdjvu_error_t *perr)
 {
-    FILE *f = fopen(path, "rb");
+    mdjvu_mapped_file_t m = mdjvu_map_file(path);
     mdjvu_bitmap_t result;
-    if (!f)
+    if (!m)
     {
         if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
         return NULL;
     }
     if (perr) *perr = NULL;
-    result = mdjvu_file_load_bmp((mdjvu_file_t) f, perr);
-    fclose(f);
+    result = mdjvu_memory_load_bmp(mdjvu_mapped_file_get_data(m),
+                                   mdjvu_mapped_file_get_size(m), perr);
+    mdjvu_unmap_file(m);
     return result;
 }
@@ -5,41 +5,116 @@
 #include "../base/mdjvucfg.h"
 #include <minidjvu-mod/minidjvu-mod.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 
-static void skip_to_the_end_of_line(FILE *file)
+/* A PBM header is parsed by the same code from a file or from memory.
+ * Numbers are read as fscanf("%d") reads them.
+ */
+typedef struct
+{
+    FILE *file; /* NULL when parsing data */
+    const unsigned char *data;
+    size_t size, pos;
+} PbmSource;
+
+static int source_getc(PbmSource *s)
+{
+    if (s->file) return fgetc(s->file);
+    return s->pos < s->size ? s->data[s->pos++] : EOF;
+}
+
+static void source_ungetc(PbmSource *s, int c)
+{
+    if (c == EOF) return;
+    if (s->file)
+        ungetc(c, s->file);
+    else
+        s->pos--;
+}
+
+static void skip_to_the_end_of_line(PbmSource *s)
 {
     while (1)
     {
-        switch(fgetc(file))
+        switch(source_getc(s))
         {
-            case -1: case '\r': case '\n':
+            case EOF: case '\r': case '\n':
                 return;
         }
     }
 }
 
-static void mdjvu_skip_pbm_whitespace_and_comments(mdjvu_file_t f)
+static void skip_pbm_whitespace_and_comments(PbmSource *s)
 {
-    FILE *file = (FILE *) f;
-    int c = fgetc(file);
+    int c = source_getc(s);
     while(1)
     {
         switch(c)
         {
             case ' ': case '\t': case '\r': case '\n':
-                c = fgetc(file);
+                c = source_getc(s);
             break;
             case '#':
-                skip_to_the_end_of_line(file);
-                c = fgetc(file);
+                skip_to_the_end_of_line(s);
+                c = source_getc(s);
             break;
             default:
-                ungetc(c,file);
+                source_ungetc(s, c);
                 return;
         }
     }
 }
 
+static int read_pbm_number(PbmSource *s, int32 *result)
+{
+    int32 n = 0;
+    int negative = 0;
+    int c;
+
+    do c = source_getc(s); while (c != EOF && isspace(c));
+    if (c == '+' || c == '-')
+    {
+        negative = c == '-';
+        c = source_getc(s);
+    }
+    if (c < '0' || c > '9')
+    {
+        source_ungetc(s, c);
+        return 0;
+    }
+    while (c >= '0' && c <= '9')
+    {
+        if (n > (INT32_MAX - 9) / 10) return 0;
+        n = n * 10 + (c - '0');
+        c = source_getc(s);
+    }
+    source_ungetc(s, c);
+    *result = negative ? -n : n;
+    return 1;
+}
+
+/* Reads the header up to the first row; returns 1 - success, 0 - failure */
+static int read_pbm_header(PbmSource *s, int32 *pwidth, int32 *pheight)
+{
+    if (source_getc(s) != 'P') return 0;
+    if (source_getc(s) != '4') return 0;
+    skip_pbm_whitespace_and_comments(s);
+    if (!read_pbm_number(s, pwidth) || !read_pbm_number(s, pheight))
+        return 0;
+
+    /* a fancy way to write if ( || || || ) - maybe, abandon this switch? */
+    switch(source_getc(s))
+    {
+        case ' ': case '\t': case '\r': case '\n':
+            break;
+        default:
+            return 0;
+    }
+    return *pwidth >= 0 && *pheight >= 0;
+}
+
 MDJVU_IMPLEMENT int mdjvu_save_pbm(mdjvu_bitmap_t b, const char *path, mdjvu_error_t *perr)
 {
     FILE *file = fopen(path, "wb");
@@ -61,37 +136,36 @@ MDJVU_IMPLEMENT int mdjvu_file_save_pbm(mdjvu_bitmap_t b, mdjvu_file_t f, mdjvu_
     int32 bytes_per_row = mdjvu_bitmap_get_packed_row_size(b);
     int32 width = mdjvu_bitmap_get_width(b);
     int32 height = mdjvu_bitmap_get_height(b);
-    int32 i;
 
     if (perr) *perr = NULL;
 
     fprintf(file, "P4\n"MDJVU_INT32_FORMAT" "MDJVU_INT32_FORMAT"\n",
             width, height);
 
-    for (i = 0; i < height; i++)
+    /* packed rows lie one after another, just like in the file */
+    if (height && bytes_per_row &&
+        fwrite(mdjvu_bitmap_access_packed_row(b, 0),
+               (size_t) bytes_per_row * height, 1, file) != 1)
     {
-        unsigned char *row = mdjvu_bitmap_access_packed_row(b, i);
-        if (fwrite(row, bytes_per_row, 1, file) != 1)
-        {
-            if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
-            return 0;
-        }
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_io);
+        return 0;
     }
     return 1;
 }
 
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *perr)
 {
-    FILE *file = fopen(path, "rb");
+    mdjvu_mapped_file_t m = mdjvu_map_file(path);
     mdjvu_bitmap_t result;
     if (perr) *perr = NULL;
-    if (!file)
+    if (!m)
     {
         if(perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
         return NULL;
     }
-    result = mdjvu_file_load_pbm((mdjvu_file_t) file, perr);
-    fclose(file);
+    result = mdjvu_memory_load_pbm(mdjvu_mapped_file_get_data(m),
+                                   mdjvu_mapped_file_get_size(m), perr);
+    mdjvu_unmap_file(m);
     return result;
 }
 
@@ -103,37 +177,146 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_pbm(const char *path, mdjvu_error_t *p
 MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_file_load_pbm(mdjvu_file_t f, mdjvu_error_t *perr)
 {
     FILE *file = (FILE *) f;
-    int32 width, height, bytes_per_row, i;
+    PbmSource source = {NULL, NULL, 0, 0};
+    int32 width, height, bytes_per_row;
     mdjvu_bitmap_t result;
     if (perr) *perr = NULL;
-    if (fgetc(file) != 'P') COMPLAIN;
-    if (fgetc(file) != '4') COMPLAIN;
-    mdjvu_skip_pbm_whitespace_and_comments((mdjvu_file_t) file);
-    if (fscanf(file,
-        MDJVU_INT32_FORMAT" "MDJVU_INT32_FORMAT, &width, &height) != 2)
+    source.file = file;
+    if (!read_pbm_header(&source, &width, &height)) COMPLAIN;
+
+    result = mdjvu_bitmap_create(width, height);
+    bytes_per_row = mdjvu_bitmap_get_packed_row_size(result);
+    if (height && fread(mdjvu_bitmap_access_packed_row(result, 0),
+                        (size_t) bytes_per_row * height, 1, file) != 1)
     {
+        mdjvu_bitmap_destroy(result);
         COMPLAIN;
     }
+    return result;
+}
 
-    /* a fancy way to write if ( || || || ) - maybe, abandon this switch? */
-    switch(fgetc(file))
+/* Copies rows that start at data[0]; size is what is left of the file. */
+static mdjvu_bitmap_t load_pbm_rows(const unsigned char *data, size_t size,
+                                    int32 width, int32 height, mdjvu_error_t *perr)
+{
+    int32 bytes_per_row = (width + 7) >> 3;
+    mdjvu_bitmap_t result;
+
+    /* rows are copied in one go, so check that they are all there first */
+    if (height && (!bytes_per_row || size / bytes_per_row < (size_t) height))
+        COMPLAIN;
+
+    result = mdjvu_bitmap_create(width, height);
+    if (height)
     {
-        case ' ': case '\t': case '\r': case '\n':
-            break;
-        default:
-            COMPLAIN;
+        memcpy(mdjvu_bitmap_access_packed_row(result, 0), data,
+               (size_t) bytes_per_row * height);
     }
+    return result;
+}
 
-    result = mdjvu_bitmap_create(width, height);
-    bytes_per_row = mdjvu_bitmap_get_packed_row_size(result);
-    for (i = 0; i < height; i++)
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_memory_load_pbm(const void *buffer, size_t size, mdjvu_error_t *perr)
+{
+    PbmSource source = {NULL, NULL, 0, 0};
+    int32 width, height;
+    if (perr) *perr = NULL;
+    source.data = (const unsigned char *) buffer;
+    source.size = size;
+    if (!read_pbm_header(&source, &width, &height)) COMPLAIN;
+    return load_pbm_rows(source.data + source.pos, size - source.pos,
+                         width, height, perr);
+}
+
+/* ______________________________   row reader   ___________________________ */
+
+struct MinidjvuPbmReader
+{
+    FILE *file;
+    char *path;
+    long rows_offset;
+    int32 width, height;
+};
+
+MDJVU_IMPLEMENT mdjvu_pbm_reader_t mdjvu_pbm_reader_open(const char *path, mdjvu_error_t *perr)
+{
+    mdjvu_pbm_reader_t reader;
+    FILE *file = fopen(path, "rb");
+    PbmSource source = {NULL, NULL, 0, 0};
+    int32 width, height;
+    if (perr) *perr = NULL;
+    if (!file)
     {
-        unsigned char *current_row = mdjvu_bitmap_access_packed_row(result, i);
-        if (fread(current_row, bytes_per_row, 1, file) != 1)
-        {
-            mdjvu_bitmap_destroy(result);
-            COMPLAIN;
-        }
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+    source.file = file;
+    if (!read_pbm_header(&source, &width, &height))
+    {
+        fclose(file);
+        COMPLAIN;
     }
+    reader = (mdjvu_pbm_reader_t) malloc(sizeof(struct MinidjvuPbmReader));
+    reader->file = file;
+    reader->path = (char *) malloc(strlen(path) + 1);
+    strcpy(reader->path, path);
+    reader->rows_offset = ftell(file);
+    reader->width = width;
+    reader->height = height;
+    return reader;
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_pbm_reader_get_width(mdjvu_pbm_reader_t reader)
+{
+    return reader->width;
+}
+
+MDJVU_IMPLEMENT int32 mdjvu_pbm_reader_get_height(mdjvu_pbm_reader_t reader)
+{
+    return reader->height;
+}
+
+MDJVU_IMPLEMENT int mdjvu_pbm_reader_read_row(mdjvu_pbm_reader_t reader, unsigned char *row, mdjvu_error_t *perr)
+{
+    if (perr) *perr = NULL;
+    if (fread(row, (reader->width + 7) >> 3, 1, reader->file) != 1)
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_pbm);
+        return 0;
+    }
+    return 1;
+}
+
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_pbm_reader_load(mdjvu_pbm_reader_t reader, mdjvu_error_t *perr)
+{
+    mdjvu_mapped_file_t m;
+    mdjvu_bitmap_t result;
+    size_t size;
+    if (perr) *perr = NULL;
+
+    m = mdjvu_map_file(reader->path);
+    if (!m || reader->rows_offset < 0)
+    {
+        if (m) mdjvu_unmap_file(m);
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+    size = mdjvu_mapped_file_get_size(m);
+    if ((size_t) reader->rows_offset > size)
+        result = NULL;
+    else
+        result = load_pbm_rows((const unsigned char *) mdjvu_mapped_file_get_data(m)
+                                   + reader->rows_offset,
+                               size - reader->rows_offset,
+                               reader->width, reader->height, perr);
+    if (!result && perr && !*perr)
+        *perr = mdjvu_get_error(mdjvu_error_corrupted_pbm);
+    mdjvu_unmap_file(m);
     return result;
 }
+
+MDJVU_IMPLEMENT void mdjvu_pbm_reader_close(mdjvu_pbm_reader_t reader)
+{
+    fclose(reader->file);
+    free(reader->path);
+    free(reader);
+}
@@ -15,30 +15,139 @@
 
 #ifdef HAVE_LIBTIFF
 
-static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_error_t *perr, uint32 idx)
+/* Strips are decoded right into the bitmap when their rows match ours. */
+static int read_strips(TIFF *tiff, mdjvu_bitmap_t bitmap)
 {
-    uint16 photometric;
-    uint32 w, h;
-    uint16 bits_per_sample = 0, samples_per_pixel = 0;
-    float dpi;
-    mdjvu_bitmap_t result;
-    tsize_t scanline_size;
-    unsigned char *scanline;
-    uint32 i;
+    uint32 h = (uint32) mdjvu_bitmap_get_height(bitmap);
+    tsize_t row_size = mdjvu_bitmap_get_packed_row_size(bitmap);
+    tsize_t scanline_size = TIFFScanlineSize(tiff);
+    unsigned char *data = mdjvu_bitmap_access_packed_row(bitmap, 0);
+    unsigned char *strip = NULL;
+    uint32 rows_per_strip = h, y;
 
-    TIFF *tiff = TIFFOpen(path, "r");
-    for ( i=0; tiff != NULL && i<idx; i++ )
+    if (scanline_size < row_size)
+        return 0;
+
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    if (!rows_per_strip || rows_per_strip > h)
+        rows_per_strip = h;
+
+    if (scanline_size != row_size)
+        strip = (unsigned char *) malloc(scanline_size * rows_per_strip);
+
+    for (y = 0; y < h; y += rows_per_strip)
     {
-        if (!TIFFReadDirectory(tiff))
-            break;
+        uint32 rows = h - y < rows_per_strip ? h - y : rows_per_strip;
+        tstrip_t s = TIFFComputeStrip(tiff, y, 0);
+
+        if (!strip)
+        {
+            if (TIFFReadEncodedStrip(tiff, s, data + y * row_size,
+                                     rows * row_size) < 0)
+                return 0;
+        }
+        else
+        {
+            uint32 i;
+            if (TIFFReadEncodedStrip(tiff, s, strip,
+                                     rows * scanline_size) < 0)
+            {
+                free(strip);
+                return 0;
+            }
+            for (i = 0; i < rows; i++)
+            {
+                memcpy(data + (y + i) * row_size,
+                       strip + i * scanline_size, row_size);
+            }
+        }
     }
 
-    *perr = NULL;
-    if (!tiff || i<idx)
+    free(strip);
+    return 1;
+}
+
+/* Gets the tile size, if we can handle it. */
+static int get_tile_size(TIFF *tiff, uint32 *ptile_w, uint32 *ptile_h)
+{
+    uint32 tile_w = 0, tile_h = 0;
+    if (!TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tile_w)
+     || !TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tile_h)
+     || !tile_w || !tile_h
+     || (tile_w & 7)) /* the spec wants multiples of 16 */
     {
-        *perr = mdjvu_get_error(mdjvu_error_fopen_read);
-        return NULL;
+        return 0;
     }
+    if (TIFFTileSize(tiff) < (tsize_t) (tile_w >> 3) * tile_h)
+        return 0;
+    *ptile_w = tile_w;
+    *ptile_h = tile_h;
+    return 1;
+}
+
+/* Reads `rows' rows from y on, decoding a row of tiles into `data'. */
+static int read_tile_row(TIFF *tiff, unsigned char *data,
+                         uint32 w, uint32 row_size, uint32 y, uint32 rows,
+                         uint32 tile_w, unsigned char *tile)
+{
+    uint32 tile_row_size = tile_w >> 3, x;
+    tsize_t tile_size = TIFFTileSize(tiff);
+
+    for (x = 0; x < w; x += tile_w)
+    {
+        uint32 offset = x >> 3, i;
+        uint32 n = row_size - offset < tile_row_size ?
+                    row_size - offset : tile_row_size;
+
+        if (TIFFReadEncodedTile(tiff, TIFFComputeTile(tiff, x, y, 0, 0),
+                                tile, tile_size) < 0)
+        {
+            return 0;
+        }
+        for (i = 0; i < rows; i++)
+            memcpy(data + i * row_size + offset, tile + i * tile_row_size, n);
+    }
+    return 1;
+}
+
+static int read_tiles(TIFF *tiff, mdjvu_bitmap_t bitmap)
+{
+    uint32 w = (uint32) mdjvu_bitmap_get_width(bitmap);
+    uint32 h = (uint32) mdjvu_bitmap_get_height(bitmap);
+    uint32 row_size = (uint32) mdjvu_bitmap_get_packed_row_size(bitmap);
+    unsigned char *data = mdjvu_bitmap_access_packed_row(bitmap, 0);
+    uint32 tile_w, tile_h, y;
+    unsigned char *tile;
+
+    if (!get_tile_size(tiff, &tile_w, &tile_h))
+        return 0;
+
+    tile = (unsigned char *) malloc(TIFFTileSize(tiff));
+
+    for (y = 0; y < h; y += tile_h)
+    {
+        uint32 rows = h - y < tile_h ? h - y : tile_h;
+        if (!read_tile_row(tiff, data + y * row_size, w, row_size,
+                           y, rows, tile_w, tile))
+        {
+            free(tile);
+            return 0;
+        }
+    }
+
+    free(tile);
+    return 1;
+}
+
+/* Checks that the current directory is bitonal and gets its parameters. */
+static int read_tiff_header(TIFF *tiff, uint32 *pw, uint32 *ph, int *pinvert,
+                            int32 *presolution, mdjvu_error_t *perr)
+{
+    uint16 photometric;
+    uint16 bits_per_sample = 0, samples_per_pixel = 0;
+    float dpi;
+
+    *perr = NULL;
 
     /* test if bitonal */
     TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
@@ -46,21 +155,20 @@ static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_erro
     if (bits_per_sample != 1 || samples_per_pixel != 1)
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
-        TIFFClose(tiff);
-        return NULL;
+        return 0;
     }
 
     /* photometric */
     photometric = PHOTOMETRIC_MINISWHITE;
     TIFFGetFieldDefaulted(tiff, TIFFTAG_PHOTOMETRIC, &photometric);
+    *pinvert = (photometric != PHOTOMETRIC_MINISWHITE);
 
     /* image size */
-    if (!TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGEWIDTH, &w)
-     || !TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGELENGTH, &h))
+    if (!TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGEWIDTH, pw)
+     || !TIFFGetFieldDefaulted(tiff, TIFFTAG_IMAGELENGTH, ph))
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
-        TIFFClose(tiff);
-        return NULL;
+        return 0;
     }
 
     /* get the resolution */
@@ -69,66 +177,226 @@ static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_erro
         *presolution = (int32) dpi;
     }
 
+    return 1;
+}
+
+/* Reads the current directory of `tiff'; doesn't close it. */
+static mdjvu_bitmap_t read_tiff_page(TIFF *tiff, int32 *presolution, mdjvu_error_t *perr)
+{
+    uint32 w, h;
+    int invert;
+    mdjvu_bitmap_t result;
+    int ok;
+
+    if (!read_tiff_header(tiff, &w, &h, &invert, presolution, perr))
+        return NULL;
+
     result = mdjvu_bitmap_create(w, h);
 
-    scanline_size = TIFFScanlineSize(tiff);
+    if (TIFFIsTiled(tiff))
+        ok = read_tiles(tiff, result);
+    else
+        ok = read_strips(tiff, result);
 
-    if (scanline_size < mdjvu_bitmap_get_packed_row_size(result))
+    if (!ok)
     {
         *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
-        TIFFClose(tiff);
         mdjvu_bitmap_destroy(result);
         return NULL;
     }
 
-    scanline = (unsigned char *) malloc(scanline_size);
+    /* both clear the padding bits */
+    if (invert)
+        mdjvu_bitmap_invert(result);
+    else
+        mdjvu_bitmap_clear_padding(result);
 
-    for (i = 0; i < h; i++)
+    return result;
+}
+
+static mdjvu_bitmap_t load_tiff(const char *path, int32 *presolution, mdjvu_error_t *perr, uint32 idx)
+{
+    mdjvu_bitmap_t result;
+    TIFF *tiff = TIFFOpen(path, "r");
+
+    if (!tiff || !TIFFSetDirectory(tiff, (tdir_t) idx))
     {
-        if (TIFFReadScanline(tiff, (tdata_t)scanline, i, 0) < 0)
+        if (tiff) TIFFClose(tiff);
+        *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+
+    result = read_tiff_page(tiff, presolution, perr);
+    TIFFClose(tiff);
+    return result;
+}
+
+/* ______________________________   page reader   __________________________ */
+
+struct MinidjvuTiffReader
+{
+    TIFF *tiff;
+    int current_is_read; /* whether next page needs TIFFReadDirectory() */
+
+    /* reading the current page row by row */
+    uint32 width, height, row_size, y;
+    int invert;
+    uint32 tile_w, tile_h;  /* 0 if the page is in strips */
+    unsigned char *buffer;  /* a scanline or a row of tiles */
+    unsigned char *tile;
+};
+
+static mdjvu_tiff_reader_t open_tiff_reader(const char *path, uint32 first_page, mdjvu_error_t *perr)
+{
+    mdjvu_tiff_reader_t reader;
+    TIFF *tiff = TIFFOpen(path, "r");
+
+    *perr = NULL;
+    if (!tiff || !TIFFSetDirectory(tiff, (tdir_t) first_page))
+    {
+        if (tiff) TIFFClose(tiff);
+        *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return NULL;
+    }
+
+    reader = (mdjvu_tiff_reader_t) malloc(sizeof(struct MinidjvuTiffReader));
+    reader->tiff = tiff;
+    reader->current_is_read = 0;
+    reader->buffer = NULL;
+    reader->tile = NULL;
+    return reader;
+}
+
+static mdjvu_bitmap_t read_next_tiff_page(mdjvu_tiff_reader_t reader, int32 *presolution, mdjvu_error_t *perr)
+{
+    if (reader->current_is_read)
+    {
+        if (!TIFFReadDirectory(reader->tiff))
         {
-            *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
-            TIFFClose(tiff);
-            free(scanline);
-            mdjvu_bitmap_destroy(result);
+            *perr = mdjvu_get_error(mdjvu_error_fopen_read);
             return NULL;
         }
+    }
+    reader->current_is_read = 1;
+    return read_tiff_page(reader->tiff, presolution, perr);
+}
+
+static int start_reading_rows(mdjvu_tiff_reader_t reader, int32 *pwidth, int32 *pheight, int32 *presolution, mdjvu_error_t *perr)
+{
+    TIFF *tiff = reader->tiff;
 
-        if (photometric != PHOTOMETRIC_MINISWHITE)
+    free(reader->buffer);
+    free(reader->tile);
+    reader->buffer = reader->tile = NULL;
+
+    if (reader->current_is_read && !TIFFReadDirectory(tiff))
+    {
+        *perr = mdjvu_get_error(mdjvu_error_fopen_read);
+        return 0;
+    }
+    reader->current_is_read = 1;
+
+    if (!read_tiff_header(tiff, &reader->width, &reader->height,
+                          &reader->invert, presolution, perr))
+    {
+        return 0;
+    }
+    reader->row_size = (reader->width + 7) >> 3;
+    reader->y = 0;
+
+    if (TIFFIsTiled(tiff))
+    {
+        if (!get_tile_size(tiff, &reader->tile_w, &reader->tile_h))
         {
-            /* invert the row */
-            int32 k;
-            int32 s = (int32) scanline_size;
-            for (k = 0; k < s; k++)
-                scanline[k] = ~scanline[k];
+            *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
+            return 0;
         }
+        reader->tile = (unsigned char *) malloc(TIFFTileSize(tiff));
+        reader->buffer = (unsigned char *)
+            malloc((size_t) reader->row_size * reader->tile_h);
+    }
+    else
+    {
+        if (TIFFScanlineSize(tiff) < (tsize_t) reader->row_size)
+        {
+            *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
+            return 0;
+        }
+        reader->tile_w = reader->tile_h = 0;
+        reader->buffer = (unsigned char *) malloc(TIFFScanlineSize(tiff));
+    }
 
-        /* clear the padding bits */
-        if (w & 7)
-            scanline[scanline_size - 1] &= ~(0xFF >> (w & 7));
+    *pwidth = (int32) reader->width;
+    *pheight = (int32) reader->height;
+    return 1;
+}
 
-        memcpy(mdjvu_bitmap_access_packed_row(result, i),
-               scanline,
-               mdjvu_bitmap_get_packed_row_size(result));
+static int read_tiff_row(mdjvu_tiff_reader_t reader, unsigned char *row, mdjvu_error_t *perr)
+{
+    uint32 y = reader->y, i;
+    const unsigned char *src;
+
+    *perr = NULL;
+    if (!reader->buffer || y >= reader->height)
+    {
+        *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
+        return 0;
     }
 
-    free(scanline);
+    if (reader->tile_h)
+    {
+        uint32 in_tile = y % reader->tile_h;
+        if (!in_tile)
+        {
+            uint32 rows = reader->height - y < reader->tile_h ?
+                            reader->height - y : reader->tile_h;
+            if (!read_tile_row(reader->tiff, reader->buffer, reader->width,
+                               reader->row_size, y, rows,
+                               reader->tile_w, reader->tile))
+            {
+                *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
+                return 0;
+            }
+        }
+        src = reader->buffer + in_tile * reader->row_size;
+    }
+    else
+    {
+        if (TIFFReadScanline(reader->tiff, reader->buffer, y, 0) < 0)
+        {
+            *perr = mdjvu_get_error(mdjvu_error_corrupted_tiff);
+            return 0;
+        }
+        src = reader->buffer;
+    }
 
-    TIFFClose(tiff);
-    return result;
+    if (reader->invert)
+    {
+        for (i = 0; i < reader->row_size; i++)
+            row[i] = (unsigned char) ~src[i];
+    }
+    else
+    {
+        memcpy(row, src, reader->row_size);
+    }
+    if (reader->width & 7)
+        row[reader->row_size - 1] &= (unsigned char) (0xFF << (8 - (reader->width & 7)));
+
+    reader->y++;
+    return 1;
 }
 
 MDJVU_IMPLEMENT uint32 mdjvu_get_tiff_page_count(const char *path)
 {
-    int dircount = 0;
+    uint32 dircount = 0;
     TIFF* tif = TIFFOpen(path, "r");
 
-    /* a "directory" is a page in a multipage tiff */
+    /* a "directory" is a page in a multipage tiff;
+     * counting them only follows the links, directories are not parsed
+     */
 
     if ( tif ) {
-        do {
-            dircount++;
-        } while ( TIFFReadDirectory(tif) );
+        dircount = TIFFNumberOfDirectories(tif);
         TIFFClose(tif);
     }
     return dircount;
@@ -145,3 +413,59 @@ MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_load_tiff(const char *path, int32 *presolut
         return NULL;
     #endif
 }
+
+MDJVU_IMPLEMENT mdjvu_tiff_reader_t mdjvu_tiff_reader_open(const char *path, uint32 first_page, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        return open_tiff_reader(path, first_page, perr);
+    #else
+        (void) path; (void) first_page;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return NULL;
+    #endif
+}
+
+MDJVU_IMPLEMENT mdjvu_bitmap_t mdjvu_tiff_reader_next(mdjvu_tiff_reader_t reader, int32 *presolution, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        return read_next_tiff_page(reader, presolution, perr);
+    #else
+        (void) reader; (void) presolution;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return NULL;
+    #endif
+}
+
+MDJVU_IMPLEMENT int mdjvu_tiff_reader_next_rows(mdjvu_tiff_reader_t reader, int32 *width, int32 *height, int32 *presolution, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        return start_reading_rows(reader, width, height, presolution, perr);
+    #else
+        (void) reader; (void) width; (void) height; (void) presolution;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return 0;
+    #endif
+}
+
+MDJVU_IMPLEMENT int mdjvu_tiff_reader_read_row(mdjvu_tiff_reader_t reader, unsigned char *row, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        return read_tiff_row(reader, row, perr);
+    #else
+        (void) reader; (void) row;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return 0;
+    #endif
+}
+
+MDJVU_IMPLEMENT void mdjvu_tiff_reader_close(mdjvu_tiff_reader_t reader)
+{
+    #ifdef HAVE_LIBTIFF
+        TIFFClose(reader->tiff);
+        free(reader->buffer);
+        free(reader->tile);
+        free(reader);
+    #else
+        (void) reader;
+    #endif
+}
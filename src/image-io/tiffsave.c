@@ -17,27 +17,16 @@
     #define COMPRESSION_PACKBITS 32771
 #endif
 
-static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *perr)
+static int write_tiff_page(TIFF *tiff, mdjvu_bitmap_t bitmap, mdjvu_error_t *perr)
 {
     int32 w = mdjvu_bitmap_get_width(bitmap);
     int32 h = mdjvu_bitmap_get_height(bitmap);
     int32 compression = COMPRESSION_NONE;
     int32 i;
-    TIFF * tiff;
-
-    *perr = NULL;
 
     if (TIFFFindCODEC(COMPRESSION_PACKBITS))
         compression = COMPRESSION_PACKBITS;
 
-    tiff = TIFFOpen(path, "w");
-
-    if (!tiff)
-    {
-        *perr = mdjvu_get_error(mdjvu_error_fopen_write);
-        return 0;
-    }
-
     /* FIXME: save resolution */
     TIFFSetField(tiff, TIFFTAG_IMAGEWIDTH, (uint32) w);
     TIFFSetField(tiff, TIFFTAG_IMAGELENGTH, (uint32) h);
@@ -59,9 +48,29 @@ static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *per
                           mdjvu_bitmap_access_packed_row(bitmap, i), i,
                           0);
 
+    return 1;
+}
+
+static int save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdjvu_error_t *perr)
+{
+    TIFF * tiff;
+    int result;
+
+    *perr = NULL;
+
+    tiff = TIFFOpen(path, "w");
+
+    if (!tiff)
+    {
+        *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return 0;
+    }
+
+    result = write_tiff_page(tiff, bitmap, perr);
+
     TIFFClose(tiff);
 
-    return 1;
+    return result;
 }
 
 #endif /* HAVE_LIBTIFF */
@@ -75,3 +84,48 @@ MDJVU_IMPLEMENT int mdjvu_save_tiff(mdjvu_bitmap_t bitmap, const char *path, mdj
         return 0;
     #endif
 }
+
+MDJVU_IMPLEMENT mdjvu_tiff_writer_t mdjvu_tiff_writer_create(const char *path, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        TIFF *tiff = TIFFOpen(path, "w");
+        *perr = NULL;
+        if (!tiff)
+            *perr = mdjvu_get_error(mdjvu_error_fopen_write);
+        return (mdjvu_tiff_writer_t) tiff;
+    #else
+        (void) path;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return NULL;
+    #endif
+}
+
+MDJVU_IMPLEMENT int mdjvu_tiff_writer_append(mdjvu_tiff_writer_t writer, mdjvu_bitmap_t bitmap, mdjvu_error_t *perr)
+{
+    #ifdef HAVE_LIBTIFF
+        TIFF *tiff = (TIFF *) writer;
+        *perr = NULL;
+        TIFFSetField(tiff, TIFFTAG_SUBFILETYPE, (uint32) FILETYPE_PAGE);
+        if (!write_tiff_page(tiff, bitmap, perr))
+            return 0;
+        if (!TIFFWriteDirectory(tiff))
+        {
+            *perr = mdjvu_get_error(mdjvu_error_io);
+            return 0;
+        }
+        return 1;
+    #else
+        (void) writer; (void) bitmap;
+        *perr = mdjvu_get_error(mdjvu_error_tiff_support_disabled);
+        return 0;
+    #endif
+}
+
+MDJVU_IMPLEMENT void mdjvu_tiff_writer_close(mdjvu_tiff_writer_t writer)
+{
+    #ifdef HAVE_LIBTIFF
+        TIFFClose((TIFF *) writer);
+    #else
+        (void) writer;
+    #endif
+}
@@ -9,13 +9,13 @@
 
 // JB2BitmapCoder implementation {{{
 
-JB2BitmapCoder::JB2BitmapCoder(ZPMemoryWatcher *w) :
-    symbol_width(0, jb2_big_positive_number, w),
-    symbol_height(0, jb2_big_positive_number, w),
+JB2BitmapCoder::JB2BitmapCoder(int32 *node_counter) :
+    symbol_width(0, jb2_big_positive_number, node_counter),
+    symbol_height(0, jb2_big_positive_number, node_counter),
     symbol_width_difference
-        (jb2_big_negative_number, jb2_big_positive_number, w),
+        (jb2_big_negative_number, jb2_big_positive_number, node_counter),
     symbol_height_difference
-        (jb2_big_negative_number, jb2_big_positive_number, w)
+        (jb2_big_negative_number, jb2_big_positive_number, node_counter)
 {
 }
 
@@ -31,52 +31,125 @@ void JB2BitmapCoder::reset_numcontexts()
     symbol_height_difference.reset();
 }
 
-void JB2BitmapCoder::code_row_directly
-    (int32 n, unsigned char *up2, unsigned char *up1, unsigned char *target,
-     unsigned char *erosion)
+// Packed rows {{{
+
+/* Rows are coded packed, as mdjvu_bitmap_t keeps them.
+ * Row buffers have one zero byte of margin on both sides,
+ * so a 24-bit window around any byte can be read without bounds checks.
+ * Bits past the width are always zero.
+ */
+
+static unsigned char *create_row(int32 bytes)
+{
+    return (unsigned char *) calloc(bytes + 2, 1) + 1;
+}
+
+static void destroy_row(unsigned char *row)
+{
+    free(row - 1);
+}
+
+static inline uint32 get_window(const unsigned char *row, int32 i)
+{
+    return ((uint32) row[i - 1] << 16) | ((uint32) row[i] << 8) | row[i + 1];
+}
+
+// mask of the valid bits in the last byte of a packed row
+static inline unsigned char get_tail_mask(int32 w)
 {
-    // demands right margin 2 from up2 and 3 from up1
+    return (unsigned char) (0xFF00 >> (((w - 1) & 7) + 1));
+}
+
+static inline unsigned get_source_byte(const unsigned char *src, int32 n,
+                                       unsigned char last, int32 q)
+{
+    if (q < 0 || q >= n) return 0;
+    return q == n - 1 ? last : src[q];
+}
+
+/* Fills dst[-1 .. bytes] so that its bit x is pixel (x + shift, y)
+ * of the prototype (zero outside of it).
+ */
+static void load_prototype_row(mdjvu_bitmap_t prototype, int32 y, int32 shift,
+                               unsigned char *dst, int32 bytes)
+{
+    int32 pw = mdjvu_bitmap_get_width(prototype);
+    int32 ph = mdjvu_bitmap_get_height(prototype);
+
+    if (y < 0 || y >= ph || !pw)
+    {
+        memset(dst - 1, 0, bytes + 2);
+        return;
+    }
 
-    /* CONTEXT is 10-bit integer organized like this:
+    const unsigned char *src = mdjvu_bitmap_access_packed_row(prototype, y);
+    int32 n = (pw + 7) >> 3;
+    unsigned char last = src[n - 1] & get_tail_mask(pw);
+
+    for (int32 i = -1; i <= bytes; i++)
+    {
+        int32 s = i * 8 + shift;
+        int32 q = s >= 0 ? s >> 3 : -((7 - s) >> 3); // floor(s / 8)
+        int r = s - q * 8;
+        unsigned two = (get_source_byte(src, n, last, q) << 8)
+                     | get_source_byte(src, n, last, q + 1);
+        dst[i] = (unsigned char) ((two << r) >> 8);
+    }
+}
+
+// Packed rows }}}
+
+void JB2BitmapCoder::code_row_directly
+    (int32 n, const unsigned char *up2, const unsigned char *up1,
+     unsigned char *target, const unsigned char *erosion)
+{
+    /* CONTEXT is 10-bit integer made of these pixels:
      *
      *     up2 -> | |A|B|C| |
      *     up1 -> |D|E|F|G|H|  - picture
      *  target -> |I|J|.| | |
      *
-     *  CONTEXT: most significant -> |J|I|H|G|F|E|D|C|B|A| <- least significant
+     *  CONTEXT: most significant -> |A|B|C|D|E|F|G|H|I|J| <- least significant
+     *
+     * That's the picture order, so the up2 and up1 parts are just cut out
+     * of 24-bit windows over the packed rows, one window per 8 pixels.
+     * (DjVuLibre numbers the bits differently, but the context only selects
+     * a cell in bitmap_direct[], so the coded data are the same.)
      */
 
-    uint16 context = 0;
-
-    // initialize bits B, C, F, G and H
-    if (up2[0]) context = 2;
-    if (up2[1]) context |= 4;
-    if (up1[0]) context |= 0x20;
-    if (up1[1]) context |= 0x40;
-    if (up1[2]) context |= 0x80;
+    int32 bytes = (n + 7) >> 3;
+    unsigned ij = 0;
 
-    for (int32 i = n; i--;)
+    for (int32 i = 0; i < bytes; i++)
     {
-        int pixel = code_pixel(bitmap_direct[context], target++, *erosion++);
-        context >>= 1;
-        context &= 0x17B; // clear H, C and J
-
-        up1++; up2++;
+        uint32 w2 = get_window(up2, i);
+        uint32 w1 = get_window(up1, i);
+        unsigned t = target[i];
+        unsigned e = erosion ? erosion[i] : 0;
+        unsigned result = 0;
+        int count = n - i * 8 < 8 ? n - i * 8 : 8;
+
+        for (int k = 0; k < count; k++)
+        {
+            unsigned context = ((w2 >> (14 - k)) & 7) << 7
+                             | ((w1 >> (13 - k)) & 0x1F) << 2
+                             | ij;
+            int pixel = code_pixel(bitmap_direct[context],
+                                   (t >> (7 - k)) & 1, (e >> (7 - k)) & 1);
+            result = (result << 1) | pixel;
+            ij = ((ij << 1) | pixel) & 3;
+        }
 
-        if (up2[1]) context |= 4;     // fill C
-        if (up1[2]) context |= 0x80;  // fill H
-        if (pixel)  context |= 0x200; // fill J
+        target[i] = (unsigned char) (result << (8 - count));
     }
 }
 
-// TODO: optimize it by unpacking "0 or 1" and ||ing with shifts
 void JB2BitmapCoder::code_row_by_refinement
-    (int32 n, unsigned char *up1, unsigned char *target, unsigned char *p_up, unsigned char *p_sm, unsigned char *p_dn,
-     unsigned char *erosion)
+    (int32 n, const unsigned char *up1, unsigned char *target,
+     const unsigned char *p_up, const unsigned char *p_sm,
+     const unsigned char *p_dn, const unsigned char *erosion)
 {
-    // demands right margin 2 from all but target and left margin 1 from p_
-
-    /* CONTEXT is 11-bit integer organized like this:
+    /* CONTEXT is 11-bit integer made of these pixels:
      *
      *     up1 -> |A|B|C|
      *  target -> |D|.| | - picture
@@ -85,35 +158,38 @@ void JB2BitmapCoder::code_row_by_refinement
      *    p_sm -> |F|G|H| - prototype
      *    p_dn -> |I|J|K|
      *
-     *  CONTEXT: 0 0 0 0  0 K J I  H G F E  D C B A
+     *  CONTEXT: 0 0 0 0  0 A B C  D E F G  H I J K
+     *
+     * (see code_row_directly() on the bit order)
      */
 
-    uint16 context = 0;
-    if (up1[0])   context  = 2;       // B
-    if (up1[1])   context |= 4;       // C
-    if (p_up[0])  context |= 0x10;    // E
-    if (p_sm[-1]) context |= 0x20;    // F
-    if (p_sm[0])  context |= 0x40;    // G
-    if (p_sm[1])  context |= 0x80;    // H
-    if (p_dn[-1]) context |= 0x100;   // I
-    if (p_dn[0])  context |= 0x200;   // J
-    if (p_dn[1])  context |= 0x400;   // K
-
+    int32 bytes = (n + 7) >> 3;
+    unsigned d = 0;
 
-    int32 x = n;
-    while (x--)
+    for (int32 i = 0; i < bytes; i++)
     {
-        int pixel = code_pixel(bitmap_refine[context], target++, *erosion++);
-        context >>= 1;
-        context &= 0x363; // clear C, D, E, H and K
-
-        up1++; p_up++; p_sm++; p_dn++;
+        uint32 w1 = get_window(up1, i);
+        uint32 wu = get_window(p_up, i);
+        uint32 ws = get_window(p_sm, i);
+        uint32 wd = get_window(p_dn, i);
+        unsigned t = target[i];
+        unsigned e = erosion ? erosion[i] : 0;
+        unsigned result = 0;
+        int count = n - i * 8 < 8 ? n - i * 8 : 8;
+
+        for (int k = 0; k < count; k++)
+        {
+            unsigned context = ((w1 >> (14 - k)) & 7) << 8
+                             | d << 7
+                             | ((wu >> (15 - k)) & 1) << 6
+                             | ((ws >> (14 - k)) & 7) << 3
+                             | ((wd >> (14 - k)) & 7);
+            d = code_pixel(bitmap_refine[context],
+                           (t >> (7 - k)) & 1, (e >> (7 - k)) & 1);
+            result = (result << 1) | d;
+        }
 
-        if (up1[1])  context |= 4;     // C
-        if (pixel)   context |= 8;     // D
-        if (p_up[0]) context |= 0x10;  // E
-        if (p_sm[1]) context |= 0x80;  // H
-        if (p_dn[1]) context |= 0x400; // K
+        target[i] = (unsigned char) (result << (8 - count));
     }
 }
 
@@ -121,19 +197,17 @@ void JB2BitmapCoder::code_image_directly(mdjvu_bitmap_t shape, mdjvu_bitmap_t er
 {
     int32 w = mdjvu_bitmap_get_width(shape);
     int32 h = mdjvu_bitmap_get_height(shape);
-    unsigned char *up2 = (unsigned char *) calloc(w + 3, 1); // 3 bytes are right margin
-    unsigned char *up1 = (unsigned char *) calloc(w + 3, 1);
-    unsigned char *target = (unsigned char *) malloc(w + 3);
-    unsigned char *erosion = (unsigned char *) calloc(w, 1);
+    int32 bytes = (w + 7) >> 3;
+    unsigned char *up2 = create_row(bytes);
+    unsigned char *up1 = create_row(bytes);
+    unsigned char *target = create_row(bytes);
     assert(!erosion_mask || mdjvu_bitmap_get_width(erosion_mask) == w);
-    target[w] = target[w + 1] = target[w + 2] = 0;
 
     for (int32 y = 0; y < h; y++)
     {
         load_row(shape, y, target);
-        if (erosion_mask)
-            mdjvu_bitmap_unpack_row(erosion_mask, erosion, y);
-        code_row_directly(w, up2, up1, target, erosion);
+        code_row_directly(w, up2, up1, target, erosion_mask ?
+            mdjvu_bitmap_access_packed_row(erosion_mask, y) : NULL);
         save_row(shape, y, target, erosion_mask != NULL);
 
         unsigned char *t = up2;
@@ -142,10 +216,9 @@ void JB2BitmapCoder::code_image_directly(mdjvu_bitmap_t shape, mdjvu_bitmap_t er
         target = t;
     }
 
-    free(up2);
-    free(up1);
-    free(target);
-    free(erosion);
+    destroy_row(up2);
+    destroy_row(up1);
+    destroy_row(target);
 }
 
 void JB2BitmapCoder::code_image_by_refinement/*{{{*/
@@ -155,17 +228,13 @@ void JB2BitmapCoder::code_image_by_refinement/*{{{*/
     int32 h = mdjvu_bitmap_get_height(shape);
     int32 pw = mdjvu_bitmap_get_width(prototype);
     int32 ph = mdjvu_bitmap_get_height(prototype);
+    int32 bytes = (w + 7) >> 3;
 
-    int32 max_width = w > pw ? w : pw;
-    unsigned char *up1    = (unsigned char *) calloc(max_width + 2, 1);
-    unsigned char *target = (unsigned char *) calloc(max_width + 2, 1);
-    unsigned char *erosion  = (unsigned char *) calloc(max_width, 1);
-    unsigned char *buf_prototype_up = (unsigned char *) calloc(max_width + 3, 1);
-    unsigned char *buf_prototype_sm = (unsigned char *) calloc(max_width + 3, 1);
-    unsigned char *buf_prototype_dn = (unsigned char *) calloc(max_width + 3, 1);
-    unsigned char *prototype_up = buf_prototype_up + 1; // to have left margin of 1
-    unsigned char *prototype_sm = buf_prototype_sm + 1; // to have left margin of 1
-    unsigned char *prototype_dn = buf_prototype_dn + 1; // to have left margin of 1
+    unsigned char *up1    = create_row(bytes);
+    unsigned char *target = create_row(bytes);
+    unsigned char *prototype_up = create_row(bytes);
+    unsigned char *prototype_sm = create_row(bytes);
+    unsigned char *prototype_dn = create_row(bytes);
 
     // align (see DjVu2 specs, page 32, bottom)
     int center_x = w - w / 2; // this favors right (but that agrees with specs)
@@ -179,83 +248,48 @@ void JB2BitmapCoder::code_image_by_refinement/*{{{*/
     int shift_y = proto_center_y - center_y;
 
     // prepare upper row -> sm, same row -> dn (to be raised in the loop)
-    int y;
-    int proto_unpack = shift_x < 0 ? -shift_x : 0;
-    int code_shift = shift_x > 0 ? shift_x : 0;
-
-    y = shift_y - 1;
-    if (y >= 0 && y < ph)
-        mdjvu_bitmap_unpack_row_0_or_1(prototype, prototype_sm + proto_unpack, y);
-    y = shift_y;
-    if (y >= 0 && y < ph)
-        mdjvu_bitmap_unpack_row_0_or_1(prototype, prototype_dn + proto_unpack, y);
-
-    for (y = 0; y < (int) h; y++)
-    {
-        // prepare three prototype rows by unpacking lower one
-        // and shifting all others
-
-        int proto_y_dn = y + shift_y + 1;
+    load_prototype_row(prototype, shift_y - 1, shift_x, prototype_sm, bytes);
+    load_prototype_row(prototype, shift_y, shift_x, prototype_dn, bytes);
 
-        if (proto_y_dn >= 0)
-        {
-            // we have to get prototype_dn or clear it
-            if (proto_y_dn < ph)
-            {
-                // rotate prototype rows to get a place for prototype_dn
-                unsigned char *t = prototype_up;
-                prototype_up = prototype_sm;
-                prototype_sm = prototype_dn;
-                prototype_dn = t;
-
-                mdjvu_bitmap_unpack_row_0_or_1(prototype,
-                                       prototype_dn + proto_unpack,
-                                       proto_y_dn);
-            }
-            else if (proto_y_dn < ph + 3)
-            {
-                unsigned char *t = prototype_up;
-                prototype_up = prototype_sm;
-                prototype_sm = prototype_dn;
-                prototype_dn = t;
-                memset(prototype_dn, 0, max_width);
-            }
-            // else all three prototype rows are and will be empty - do nothing
-        }
+    for (int32 y = 0; y < h; y++)
+    {
+        // rotate prototype rows and load the lower one
+        unsigned char *t = prototype_up;
+        prototype_up = prototype_sm;
+        prototype_sm = prototype_dn;
+        prototype_dn = t;
+        load_prototype_row(prototype, y + shift_y + 1, shift_x, prototype_dn, bytes);
 
         // code y-th row
         load_row(shape, y, target);
-        if (erosion_mask)
-            mdjvu_bitmap_unpack_row(erosion_mask, erosion, y);
         code_row_by_refinement(w, up1, target,
-                               prototype_up + code_shift,
-                               prototype_sm + code_shift,
-                               prototype_dn + code_shift, erosion);
+                               prototype_up, prototype_sm, prototype_dn,
+                               erosion_mask ?
+            mdjvu_bitmap_access_packed_row(erosion_mask, y) : NULL);
         save_row(shape, y, target, erosion_mask != NULL);
 
-        unsigned char *t = up1;
+        t = up1;
         up1 = target;
         target = t;
     }
 
-    free(up1);
-    free(target);
-    free(erosion);
-    free(buf_prototype_up);
-    free(buf_prototype_sm);
-    free(buf_prototype_dn);
+    destroy_row(up1);
+    destroy_row(target);
+    destroy_row(prototype_up);
+    destroy_row(prototype_sm);
+    destroy_row(prototype_dn);
 }/*}}}*/
 
 // JB2BitmapCoder }}}
 
 // JB2BitmapDecoder implementation {{{
 
-JB2BitmapDecoder::JB2BitmapDecoder(ZPDecoder &z, ZPMemoryWatcher *w)
-    : JB2BitmapCoder(w), zp(z) {}
+JB2BitmapDecoder::JB2BitmapDecoder(ZPDecoder &z, int32 *node_counter)
+    : JB2BitmapCoder(node_counter), zp(z) {}
 
-int JB2BitmapDecoder::code_pixel(ZPBitContext &context, unsigned char *pixel, int erosion)
+int JB2BitmapDecoder::code_pixel(ZPBitContext &context, int pixel, int erosion)
 {
-    return *pixel = zp.decode(context);
+    return zp.decode(context);
 }
 
 mdjvu_bitmap_t JB2BitmapDecoder::decode(mdjvu_image_t img, mdjvu_bitmap_t proto)
@@ -288,22 +322,23 @@ void JB2BitmapDecoder::load_row(mdjvu_bitmap_t sh, int32 y, unsigned char *row){
 
 void JB2BitmapDecoder::save_row(mdjvu_bitmap_t sh, int32 y, unsigned char *row, int erosion)
 {
-    mdjvu_bitmap_pack_row(sh, row, y);
+    memcpy(mdjvu_bitmap_access_packed_row(sh, y), row,
+           mdjvu_bitmap_get_packed_row_size(sh));
 }
 
 // JB2BitmapDecoder }}}
 
 // JB2BitmapEncoder implementation {{{
 
-JB2BitmapEncoder::JB2BitmapEncoder(ZPEncoder &z, ZPMemoryWatcher *w):
-    JB2BitmapCoder(w), zp(z) {}
+JB2BitmapEncoder::JB2BitmapEncoder(ZPEncoder &z, int32 *node_counter):
+    JB2BitmapCoder(node_counter), zp(z) {}
 
-int JB2BitmapEncoder::code_pixel(ZPBitContext &context, unsigned char *pixel, int erosion)
+int JB2BitmapEncoder::code_pixel(ZPBitContext &context, int pixel, int erosion)
 {
     if (erosion)
-        *pixel = context.get_more_probable_bit();
-    zp.encode(*pixel, context);
-    return *pixel;
+        pixel = context.get_more_probable_bit();
+    zp.encode(pixel, context);
+    return pixel;
 }
 
 void JB2BitmapEncoder::encode(mdjvu_bitmap_t sh, mdjvu_bitmap_t proto, mdjvu_bitmap_t erosion_mask)
@@ -333,12 +368,16 @@ void JB2BitmapEncoder::encode(mdjvu_bitmap_t sh, mdjvu_bitmap_t proto, mdjvu_bit
 void JB2BitmapEncoder::save_row(mdjvu_bitmap_t sh, int32 y, unsigned char *row, int erosion)
 {
     if (erosion)
-        mdjvu_bitmap_pack_row(sh, row, y);
+        memcpy(mdjvu_bitmap_access_packed_row(sh, y), row,
+               mdjvu_bitmap_get_packed_row_size(sh));
 }
 
 void JB2BitmapEncoder::load_row(mdjvu_bitmap_t sh, int32 y, unsigned char *row)
 {
-    mdjvu_bitmap_unpack_row_0_or_1(sh, row, y);
+    int32 bytes = mdjvu_bitmap_get_packed_row_size(sh);
+    if (!bytes) return;
+    memcpy(row, mdjvu_bitmap_access_packed_row(sh, y), bytes);
+    row[bytes - 1] &= get_tail_mask(mdjvu_bitmap_get_width(sh));
 }
 
 // JB2BitmapEncoder }}}
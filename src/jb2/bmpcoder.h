@@ -20,25 +20,27 @@ class JB2BitmapCoder
             symbol_height,
             symbol_width_difference,
             symbol_height_difference;
-        JB2BitmapCoder(ZPMemoryWatcher *w = NULL);
+        JB2BitmapCoder(int32 *node_counter = NULL);
 
         virtual ~JB2BitmapCoder();
 
-        void code_row_directly(int32 n, unsigned char *up2,
-                                        unsigned char *up1,
+        // rows are packed; erosion is a packed row of the mask or NULL
+        void code_row_directly(int32 n, const unsigned char *up2,
+                                        const unsigned char *up1,
                                         unsigned char *target,
-                                        unsigned char *erosion);
+                                        const unsigned char *erosion);
         void code_row_by_refinement(int32 n,
-                                    unsigned char *up1,
+                                    const unsigned char *up1,
                                     unsigned char *target,
-                                    unsigned char *p_up,
-                                    unsigned char *p_sm,
-                                    unsigned char *p_dn,
-                                    unsigned char *erosion);
+                                    const unsigned char *p_up,
+                                    const unsigned char *p_sm,
+                                    const unsigned char *p_dn,
+                                    const unsigned char *erosion);
         void code_image_directly(mdjvu_bitmap_t, mdjvu_bitmap_t erosion_mask);
         void code_image_by_refinement(mdjvu_bitmap_t, mdjvu_bitmap_t prototype, mdjvu_bitmap_t erosion_mask);
 
-        virtual int code_pixel(ZPBitContext &, unsigned char *pixel, int erosion) = 0;
+        // returns the pixel actually coded (0 or 1)
+        virtual int code_pixel(ZPBitContext &, int pixel, int erosion) = 0;
         virtual void load_row(mdjvu_bitmap_t, int32 y, unsigned char *row) = 0;
         virtual void save_row(mdjvu_bitmap_t, int32 y, unsigned char *row, int erosion) = 0;
 };
@@ -48,11 +50,11 @@ class JB2BitmapDecoder : public JB2BitmapCoder
     public:
         mdjvu_bitmap_t decode(mdjvu_image_t,
                               mdjvu_bitmap_t prototype = NULL);
-        JB2BitmapDecoder(ZPDecoder &, ZPMemoryWatcher *w = NULL);
+        JB2BitmapDecoder(ZPDecoder &, int32 *node_counter = NULL);
     private:
         ZPDecoder &zp;
         // JB3BitmapDecoder jb3; /* XXX */
-        virtual int code_pixel(ZPBitContext &, unsigned char *pixel, int erosion);
+        virtual int code_pixel(ZPBitContext &, int pixel, int erosion);
         virtual void load_row(mdjvu_bitmap_t, int32 y, unsigned char *row);
         virtual void save_row(mdjvu_bitmap_t, int32 y, unsigned char *row, int erosion);
 };
@@ -61,11 +63,11 @@ class JB2BitmapEncoder : public JB2BitmapCoder
 {
     public:
         void encode(mdjvu_bitmap_t, mdjvu_bitmap_t prototype = NULL, mdjvu_bitmap_t erosion_mask = NULL);
-        JB2BitmapEncoder(ZPEncoder &, ZPMemoryWatcher *w = NULL);
+        JB2BitmapEncoder(ZPEncoder &, int32 *node_counter = NULL);
     private:
         ZPEncoder &zp;
         // JB3BitmapEncoder jb3; /* XXX */
-        virtual int code_pixel(ZPBitContext &, unsigned char *pixel, int erosion);
+        virtual int code_pixel(ZPBitContext &, int pixel, int erosion);
         virtual void load_row(mdjvu_bitmap_t, int32 y, unsigned char *row);
         virtual void save_row(mdjvu_bitmap_t, int32 y, unsigned char *row, int erosion);
 };
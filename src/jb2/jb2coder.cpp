@@ -8,26 +8,29 @@
 // JB2Coder implementation {{{
 
 JB2Coder::JB2Coder() :
-    watcher(),
-    image_size(0, jb2_big_positive_number, &watcher),
-    matching_symbol_index(0, 0, &watcher),// changed on the fly
-    symbol_column_number(0, 0, &watcher), // changed after start_of_image
-    symbol_row_number(0, 0, &watcher),    // changed after start_of_image
+    allocated_nodes(0),
+    image_size(0, jb2_big_positive_number, &allocated_nodes),
+    matching_symbol_index(0, 0, &allocated_nodes),// changed on the fly
+    symbol_column_number(0, 0, &allocated_nodes), // changed after start_of_image
+    symbol_row_number(0, 0, &allocated_nodes),    // changed after start_of_image
     same_line_column_offset
-        (jb2_big_negative_number, jb2_big_positive_number, &watcher),
+        (jb2_big_negative_number, jb2_big_positive_number, &allocated_nodes),
     same_line_row_offset
-        (jb2_big_negative_number, jb2_big_positive_number, &watcher),
+        (jb2_big_negative_number, jb2_big_positive_number, &allocated_nodes),
     new_line_column_offset
-        (jb2_big_negative_number, jb2_big_positive_number, &watcher),
+        (jb2_big_negative_number, jb2_big_positive_number, &allocated_nodes),
     new_line_row_offset
-        (jb2_big_negative_number, jb2_big_positive_number, &watcher),
-    comment_length(0, jb2_big_positive_number, &watcher),
-    comment_octet(0, 255, &watcher),
-    required_dictionary_size(0, jb2_big_positive_number, &watcher),
-    record_type(0, 11, &watcher),
+        (jb2_big_negative_number, jb2_big_positive_number, &allocated_nodes),
+    comment_length(0, jb2_big_positive_number, &allocated_nodes),
+    comment_octet(0, 255, &allocated_nodes),
+    required_dictionary_size(0, jb2_big_positive_number, &allocated_nodes),
+    record_type(0, 11, &allocated_nodes),
     first(-1, 0, 0, 1),
     line_counter(0)
 {
+    // these intervals are small and fixed
+    comment_octet.allocate_whole_tree();
+    record_type.allocate_whole_tree();
 }
 
 JB2Coder::~JB2Coder()
@@ -54,6 +57,8 @@ void JB2Coder::reset_numcontexts()
 
 JB2Decoder::JB2Decoder(FILE *f, int32 length)
  : JB2BitmapDecoder(zp), zp(f, length) {}
+JB2Decoder::JB2Decoder(const unsigned char *chunk, int32 length)
+ : JB2BitmapDecoder(zp), zp(chunk, length) {}
 JB2Encoder::JB2Encoder(FILE *f)
  : JB2BitmapEncoder(zp), zp(f), no_symbols_yet(true) {}
 
@@ -185,9 +190,8 @@ void JB2Encoder::encode_character_position(int x, int y, int w, int h)/*{{{*/
 
 // Coding character positions }}}
 
-int32 JB2Decoder::decode_blit(mdjvu_image_t img, int32 shape_index)
+int32 JB2Decoder::decode_blit(mdjvu_image_t img, mdjvu_bitmap_t shape)
 {
-    mdjvu_bitmap_t shape = mdjvu_image_get_bitmap(img, shape_index);
     int32 w = mdjvu_bitmap_get_width(shape);
     int32 h = mdjvu_bitmap_get_height(shape);
     int32 x, y;
@@ -209,12 +213,12 @@ void JB2Encoder::open_record(JB2RecordType type)
 
 void JB2Encoder::close_record()
 {
-    if (watcher.count > JB2_NUMBER_CONTEXTS_MEMORY_BOUND)
+    if (allocated_nodes > JB2_NUMBER_CONTEXTS_MEMORY_BOUND)
     {
         zp.encode(jb2_require_dictionary_or_reset, record_type);
         JB2Coder::reset_numcontexts();
         JB2BitmapEncoder::reset_numcontexts();
-        watcher.reset();
+        allocated_nodes = 0;
     }
 }
 
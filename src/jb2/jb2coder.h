@@ -21,27 +21,13 @@ struct JB2Rect
 
 // JB2Coder interface {{{
 
-/* Watcher interface + implementation {{{ */
-
-struct Watcher : ZPMemoryWatcher
-{
-    int32 count;
-    Watcher() : count(0) {}
-
-    virtual void handle_allocation()
-    {
-        count++;
-    }
-
-    void reset() {count = 0;}
-};
-
-/* Watcher }}} */
-
 class JB2Coder
 {
     public:
-        Watcher watcher;
+        /* Number of nodes allocated in the number contexts below
+         * since the last reset (see JB2_NUMBER_CONTEXTS_MEMORY_BOUND).
+         */
+        int32 allocated_nodes;
         ZPNumContext
             image_size,
             matching_symbol_index,
@@ -74,10 +60,11 @@ struct JB2Decoder : JB2Coder, JB2BitmapDecoder
 {
     ZPDecoder zp;
     JB2Decoder(FILE *f, int32 chunk_length);
+    JB2Decoder(const unsigned char *chunk, int32 chunk_length);
     JB2RecordType decode_record_type();
 
     // decodes character position and creates a new blit
-    int32 decode_blit(mdjvu_image_t, int32 shape_index);
+    int32 decode_blit(mdjvu_image_t, mdjvu_bitmap_t shape);
 
     void reset(); // resets numcontexts as required by "reset" record
 
@@ -25,12 +25,11 @@ static mdjvu_bitmap_t decode_lib_shape/*{{{*/
     (JB2Decoder &jb2, mdjvu_image_t img, bool with_blit, mdjvu_bitmap_t proto)
 {
     int32 blit = -1; // to please compilers
-    int32 index = mdjvu_image_get_bitmap_count(img);
 
     mdjvu_bitmap_t shape = jb2.decode(img, proto);
     if (with_blit)
     {
-        blit = jb2.decode_blit(img, index);
+        blit = jb2.decode_blit(img, shape);
     }
 
     int32 x, y;
@@ -50,11 +49,9 @@ static mdjvu_bitmap_t decode_lib_shape/*{{{*/
     if (perr) *perr = mdjvu_get_error(mdjvu_error_corrupted_jb2); \
     return NULL; \
 }
-MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 length, mdjvu_error_t *perr)/*{{{*/
+static mdjvu_image_t load_jb2(JB2Decoder &jb2, mdjvu_image_t dict, mdjvu_error_t *perr)/*{{{*/
 {
     if (perr) *perr = NULL;
-    FILE *f = (FILE *) file;
-    JB2Decoder jb2(f, length);
     ZPDecoder &zp = jb2.zp;
 
     int32 d = 0;
@@ -68,19 +65,52 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
 
     if (t != jb2_start_of_image) COMPLAIN;
 
+    if (d && (!dict || d > mdjvu_image_get_bitmap_count(dict)))
+    {
+        if (perr) *perr = mdjvu_get_error(mdjvu_error_djvu_no_dictionary);
+        return NULL;
+    }
+
     int32 w = zp.decode(jb2.image_size);
     int32 h = zp.decode(jb2.image_size);
     zp.decode(jb2.eventual_image_refinement); // dropped
     jb2.symbol_column_number.set_interval(1, w);
     jb2.symbol_row_number.set_interval(1, h);
 
-    mdjvu_image_t img = mdjvu_image_create(w, h); /* d is dropped for now - XXX*/
+    mdjvu_image_t img = mdjvu_image_create(w, h);
 
     int32 lib_count = 0, lib_alloc = 128;
     mdjvu_bitmap_t *library;
 
+    while (lib_alloc < d) lib_alloc <<= 1;
     library = (mdjvu_bitmap_t *) malloc(lib_alloc * sizeof(mdjvu_bitmap_t));
 
+    // The first d library shapes come from the shared dictionary,
+    // in the order it was encoded.
+    if (d)
+    {
+        int32 i, n = mdjvu_image_get_bitmap_count(dict);
+        bool indexed = mdjvu_image_has_dictionary_indices(dict) != 0;
+        for (i = 0; i < d; i++) library[i] = NULL;
+        for (i = 0; i < n; i++)
+        {
+            mdjvu_bitmap_t b = mdjvu_image_get_bitmap(dict, i);
+            int32 k = indexed ? mdjvu_image_get_dictionary_index(dict, b) : i;
+            if (k >= 0 && k < d) library[k] = b;
+        }
+        for (i = 0; i < d; i++)
+        {
+            if (!library[i])
+            {
+                mdjvu_image_destroy(img);
+                free(library);
+                COMPLAIN;
+            }
+        }
+        lib_count = d;
+        mdjvu_image_set_dictionary(img, dict);
+    }
+
     while(1)
     {
         t = jb2.decode_record_type();
@@ -96,8 +126,7 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
             break;
             case jb2_new_symbol_add_to_image_only:
             {
-                jb2.decode(img);
-                jb2.decode_blit(img, mdjvu_image_get_bitmap_count(img)-1);
+                jb2.decode_blit(img, jb2.decode(img));
             }
             break;
             case jb2_matched_symbol_with_refinement_add_to_image_and_library:
@@ -138,8 +167,7 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
                 }
                 jb2.matching_symbol_index.set_interval(0, lib_count - 1);
                 int32 match = zp.decode(jb2.matching_symbol_index);
-                jb2.decode(img, library[match]);
-                jb2.decode_blit(img, mdjvu_image_get_bitmap_count(img)-1);
+                jb2.decode_blit(img, jb2.decode(img, library[match]));
             }
             break;
             case jb2_matched_symbol_copy_to_image_without_refinement:
@@ -152,7 +180,7 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
                 }
                 jb2.matching_symbol_index.set_interval(0, lib_count - 1);
                 int32 match = zp.decode(jb2.matching_symbol_index);
-                jb2.decode_blit(img, match);
+                jb2.decode_blit(img, library[match]);
             }
             break;
             case jb2_non_symbol_data:
@@ -161,6 +189,9 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
                 int32 x = zp.decode(jb2.symbol_column_number) - 1;
                 int32 y = h - zp.decode(jb2.symbol_row_number);
                 mdjvu_image_add_blit(img, x, y, bmp);
+                /* mark it for mdjvu_split_image() */
+                mdjvu_image_enable_suspiciously_big_flags(img);
+                mdjvu_image_set_suspiciously_big_flag(img, bmp, 1);
             }
             break;
 
@@ -185,3 +216,29 @@ MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 lengt
         } // switch
     } // while(1)
 }/*}}}*/
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2(mdjvu_file_t file, int32 length, mdjvu_error_t *perr)
+{
+    JB2Decoder jb2((FILE *) file, length);
+    return load_jb2(jb2, NULL, perr);
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_file_load_jb2_with_dictionary(mdjvu_file_t file, int32 length,
+    mdjvu_image_t dict, mdjvu_error_t *perr)
+{
+    JB2Decoder jb2((FILE *) file, length);
+    return load_jb2(jb2, dict, perr);
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_memory_load_jb2(const void *data, int32 length, mdjvu_error_t *perr)
+{
+    JB2Decoder jb2((const unsigned char *) data, length);
+    return load_jb2(jb2, NULL, perr);
+}
+
+MDJVU_IMPLEMENT mdjvu_image_t mdjvu_memory_load_jb2_with_dictionary(const void *data, int32 length,
+    mdjvu_image_t dict, mdjvu_error_t *perr)
+{
+    JB2Decoder jb2((const unsigned char *) data, length);
+    return load_jb2(jb2, dict, perr);
+}
@@ -289,3 +289,25 @@ MDJVU_IMPLEMENT int mdjvu_save_jb2_dictionary(mdjvu_image_t image, const char *p
     return result;
 }
 
+
+typedef int (*jb2_file_saver_t)(mdjvu_image_t, mdjvu_file_t, mdjvu_error_t *, int);
+
+static int save_jb2_to_memory(jb2_file_saver_t saver, mdjvu_image_t image,
+    void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion)
+{
+    mdjvu_memory_file_t m = mdjvu_memory_file_create();
+    if (perr) *perr = NULL;
+    return mdjvu_memory_file_finish(m,
+        m && saver(image, mdjvu_memory_file_get_file(m), perr, erosion),
+        pbuffer, plength, perr);
+}
+
+MDJVU_IMPLEMENT int mdjvu_memory_save_jb2(mdjvu_image_t image, void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion)
+{
+    return save_jb2_to_memory(mdjvu_file_save_jb2, image, pbuffer, plength, perr, erosion);
+}
+
+MDJVU_IMPLEMENT int mdjvu_memory_save_jb2_dictionary(mdjvu_image_t image, void **pbuffer, int32 *plength, mdjvu_error_t *perr, int erosion)
+{
+    return save_jb2_to_memory(mdjvu_file_save_jb2_dictionary, image, pbuffer, plength, perr, erosion);
+}
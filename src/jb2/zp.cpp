@@ -11,76 +11,73 @@
 #include <stdlib.h>
 #include "zp.h"
 
-ZPMemoryWatcher::~ZPMemoryWatcher()
-{
-}
-
-
 // NumContext {{{
 
 enum {numcontext_first_allocation_size = 512};
 void ZPNumContext::init()/*{{{*/
 {
     n = 1;
-    nodes[0].value = 0;
-    left[0] = right[0] = 0;
+    nodes[0].bit.value = 0;
+    nodes[0].left = nodes[0].right = 0;
 }/*}}}*/
-ZPNumContext::ZPNumContext(int32 amin, int32 amax, ZPMemoryWatcher *w)/*{{{*/
-    : min(amin), max(amax), watcher(w)
+ZPNumContext::ZPNumContext(int32 amin, int32 amax, int32 *counter)/*{{{*/
+    : min(amin), max(amax), node_counter(counter)
 {
     assert(amin <= amax);
     allocated = numcontext_first_allocation_size;
-    nodes = (ZPBitContext *) malloc(allocated * sizeof(ZPBitContext));
-    left  = (uint16 *) malloc(allocated * sizeof(uint16));
-    right = (uint16 *) malloc(allocated * sizeof(uint16));
+    nodes = (Node *) malloc(allocated * sizeof(Node));
     init();
 }/*}}}*/
+void ZPNumContext::allocate_whole_tree()/*{{{*/
+{
+    // walking every value creates every node the interval can need
+    int32 *counter = node_counter;
+    node_counter = NULL;
+    init();
+    for (int32 v = min; v <= max; v++)
+        walk(v);
+    allocated = n;
+    nodes = (Node *) realloc((void *) nodes, allocated * sizeof(Node));
+    init();
+    node_counter = counter;
+}/*}}}*/
 ZPNumContext::~ZPNumContext()/*{{{*/
 {
     free(nodes);
-    free(left);
-    free(right);
 }/*}}}*/
-uint16 ZPNumContext::get_left(uint16 i)/*{{{*/
+inline uint32 ZPNumContext::get_left(uint32 i)/*{{{*/
 {
     assert(i < n);
-    uint16 r = left[i];
+    uint32 r = nodes[i].left;
     if (r) return r;
     r = new_node();
-    left[i] = r;
+    nodes[i].left = r;
     return r;
 }/*}}}*/
-uint16 ZPNumContext::get_right(uint16 i)/*{{{*/
+inline uint32 ZPNumContext::get_right(uint32 i)/*{{{*/
 {
     assert(i < n);
-    uint16 r = right[i];
+    uint32 r = nodes[i].right;
     if (r) return r;
     r = new_node();
-    right[i] = r;
+    nodes[i].right = r;
     return r;
 }/*}}}*/
-uint16 ZPNumContext::new_node()/*{{{*/
+uint32 ZPNumContext::new_node()/*{{{*/
 {
     if (n == allocated)
     {
         allocated <<= 1;
-        nodes = (ZPBitContext *) realloc(nodes, allocated * sizeof(*nodes));
-        left  = (uint16 *)       realloc(left , allocated * sizeof(*left));
-        right = (uint16 *)       realloc(right, allocated * sizeof(*right));
+        nodes = (Node *) realloc((void *) nodes, allocated * sizeof(Node));
     }
-    nodes[n].value = 0;
-    left[n] = 0;
-    right[n] = 0;
-    if (watcher)
-        watcher->handle_allocation();
+    nodes[n].bit.value = 0;
+    nodes[n].left = nodes[n].right = 0;
+    if (node_counter)
+        ++*node_counter;
     return n++;
 }/*}}}*/
 void ZPNumContext::reset()/*{{{*/
 {
-    allocated = numcontext_first_allocation_size;
-    nodes = (ZPBitContext *) realloc(nodes, allocated * sizeof(ZPBitContext));
-    left  = (uint16 *) realloc(left, allocated * sizeof(uint16));
-    right = (uint16 *) realloc(right, allocated * sizeof(uint16));
     init();
 }/*}}}*/
 void ZPNumContext::set_interval(int32 new_min, int32 new_max)/*{{{*/
@@ -89,6 +86,53 @@ void ZPNumContext::set_interval(int32 new_min, int32 new_max)/*{{{*/
     min = new_min;
     max = new_max;
 }/*}}}*/
+void ZPNumContext::walk(int32 value)/*{{{*/
+{
+    // the same path as ZPEncoder::encode() takes, without coding
+    int32 cutoff = 0;
+    uint32 range = 0xFFFFFFFF;
+    uint32 current_node = 0;
+    int phase = 1;
+
+    while (range != 1)
+    {
+        bool decision = value >= cutoff;
+        current_node = decision ? get_right(current_node)
+                                : get_left (current_node);
+        switch (phase)
+        {
+            case 1:
+                if (!decision) value = - value - 1;
+                phase = 2; cutoff = 1;
+            break;
+            case 2:
+                if (!decision)
+                {
+                    phase = 3;
+                    range = (cutoff + 1) / 2;
+                    if (range == 1)
+                        cutoff = 0;
+                    else
+                        cutoff -= range / 2;
+                }
+                else
+                    cutoff += cutoff + 1;
+            break;
+            case 3:
+                range /= 2;
+                if (range != 1)
+                {
+                    if (!decision)
+                        cutoff -= range / 2;
+                    else
+                        cutoff += range / 2;
+                }
+                else if (!decision)
+                    cutoff--;
+            break;
+        }
+    }
+}/*}}}*/
 
 // NumContext }}}
 
@@ -352,7 +396,7 @@ void ZPEncoder::encode(int32 n, ZPNumContext &context)/*{{{*/
     bool negative =false;
     int32 cutoff = 0;
     uint32 range = 0xFFFFFFFF;
-    uint16 current_node = 0;
+    uint32 current_node = 0;
     int phase = 1;
     int32 low = context.min;
     int32 high = context.max;
@@ -364,7 +408,7 @@ void ZPEncoder::encode(int32 n, ZPNumContext &context)/*{{{*/
         bool decision;
         decision = n >= cutoff;
         if (low < cutoff && cutoff <= high)
-            encode(decision, context.nodes[current_node]);
+            encode(decision, context.nodes[current_node].bit);
 
         // context for new bit
         current_node = decision
@@ -460,14 +504,24 @@ void ZPEncoder::encode(Bit bit, ZPBitContext &context) /*{{{*/
 inline bool ZPDecoder::next_byte(unsigned char &b)/*{{{*/
 {
     if (!bytes_left) return false;
-    int c = fgetc(file);
-    if (c == EOF) return false;
+    if (data)
+        b = *data++;
+    else
+    {
+        int c = fgetc(file);
+        if (c == EOF) return false;
+        b = c;
+    }
     bytes_left--;
-    b = c;
     return true;
 }/*}}}*/
 ZPDecoder::ZPDecoder(FILE *f, int32 len)/*{{{*/
-    : file(f), a(0), fence(0), bytes_left(len)
+    : file(f), data(NULL), a(0), fence(0), bytes_left(len)
+{
+    open();
+}/*}}}*/
+ZPDecoder::ZPDecoder(const unsigned char *d, int32 len)/*{{{*/
+    : file(NULL), data(d), a(0), fence(0), bytes_left(len)
 {
     open();
 }/*}}}*/
@@ -565,7 +619,7 @@ int32 ZPDecoder::decode(ZPNumContext &context)/*{{{*/
     bool negative=false;
     int32 cutoff = 0;
     uint32 range = 0xFFFFFFFF;
-    uint16 current_node = 0;
+    uint32 current_node = 0;
     int phase = 1;
     int32 low = context.min;
     int32 high = context.max;
@@ -575,7 +629,7 @@ int32 ZPDecoder::decode(ZPNumContext &context)/*{{{*/
         // decoding-specific
         bool decision;
         decision = low >= cutoff ||
-                   (high >= cutoff && decode(context.nodes[current_node]));
+                   (high >= cutoff && decode(context.nodes[current_node].bit));
 
         // context for new bit
         current_node = decision
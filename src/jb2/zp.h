@@ -43,42 +43,40 @@ class ZPBitContext
 inline ZPBitContext::ZPBitContext(): value(0) {}
 
 
-/* ZPMemoryWatcher is a purely abstract class.
- * Its only goal is to receive notifications
- *     when a ZPNumContext has allocated a bit context.
- * This unit contains no implementation of ZPMemoryWatcher.
- */
-class ZPMemoryWatcher
-{
-    public:
-        virtual void handle_allocation() = 0;
-    virtual ~ZPMemoryWatcher();
-};
-
-
 /* ZPNumContext is a tree of ZPBitContexts.
  * Its nodes are accessed by indices.
  * Root node always has the index of 0.
  *
- * Nodes are created automatically.
+ * Nodes are created automatically in a flat array which only grows;
+ * reset() forgets the nodes but keeps the storage.
+ * allocate_whole_tree() sizes the storage for every node of the current
+ * interval (meant for small ones that never change), which then never grows.
+ * If node_counter is not NULL, it's incremented for every new node,
+ * so several contexts may share a node budget (see JB2Coder).
  */
 class ZPNumContext
 {
     public:
-        ZPNumContext(int32 amin, int32 amax, ZPMemoryWatcher *w = NULL);
+        ZPNumContext(int32 amin, int32 amax, int32 *node_counter = NULL);
         ~ZPNumContext();
         void set_interval(int32 new_min, int32 new_max);
         void reset();
+        void allocate_whole_tree();
     private:
+        struct Node
+        {
+            ZPBitContext bit;
+            uint32 left, right; // 0 means nil
+        };
         int32 min, max;
-        ZPMemoryWatcher *watcher;
-        ZPBitContext *nodes;
-        uint16 n;
-        uint16 allocated;
-        uint16 *left, *right; // 0 means nil
-        uint16 new_node();
-        uint16 get_left(uint16);
-        uint16 get_right(uint16);
+        int32 *node_counter;
+        Node *nodes;
+        uint32 n;
+        uint32 allocated;
+        uint32 new_node();
+        void walk(int32 value);
+        inline uint32 get_left(uint32);
+        inline uint32 get_right(uint32);
         void init();
     friend class ZPEncoder;
     friend class ZPDecoder;
@@ -116,11 +114,13 @@ class ZPDecoder
 {
     public:
         ZPDecoder(FILE *, int32 length); // does not close it on destruction
+        ZPDecoder(const unsigned char *data, int32 length); // does not copy it
         Bit decode_without_context();
         Bit decode(ZPBitContext &);
         int32 decode(ZPNumContext &);
     private:
         FILE *file;
+        const unsigned char *data; // if not NULL, read from here instead of file
         uint32 a, code, fence, buffer;
         int32 bytes_left;
         unsigned char byte, scount, delay;
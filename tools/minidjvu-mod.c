@@ -10,6 +10,8 @@
 #include <math.h>
 #include <assert.h>
 #include <locale.h>
+#include <time.h>
+#include <errno.h>
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -93,7 +95,7 @@ static void init_default_options() {
 
 /* ========================================================================= */
 
-/* file name template routines (for multipage encoding) {{{ */
+/* file name template routines (for multipage encoding and decoding) {{{ */
 
 static int get_ext_delim_pos(const char *fname)
 {
@@ -158,6 +160,22 @@ static char *get_page_or_dict_name(char **elements, int cnt, const char *fname)
     return(page_name);
 }
 
+/* "out.pbm" -> "out#001.pbm" (pages are numbered from 1) */
+static char *get_page_file_name(const char *fname, int page)
+{
+    int extpos = get_ext_delim_pos(fname);
+    char *name = MDJVU_MALLOCV(char, strlen(fname) + 16);
+
+    if (extpos > 0)
+    {
+        memcpy(name, fname, extpos - 1);
+        sprintf(name + extpos - 1, "#%03d%s", page, fname + extpos - 1);
+    }
+    else
+        sprintf(name, "%s#%03d", fname, page);
+    return name;
+}
+
 static void replace_suffix(char *name, const char *suffix)
 {
     int len = strlen(name);
@@ -166,7 +184,7 @@ static void replace_suffix(char *name, const char *suffix)
     strcat(name, suffix);
 }
 
-/* file name template routines (for multipage encoding) }}} */
+/* file name template routines (for multipage encoding and decoding) }}} */
 
 /* ========================================================================= */
 
@@ -190,9 +208,11 @@ static void show_usage_and_exit(void)           /* {{{ */
     printf(_("    minidjvu-mod [options] <input file> <output file>\n"));
     printf(_("multiple pages encoding:\n"));
     printf(_("    minidjvu-mod [options] <input file> ... <output file>\n"));
+    printf(_("multiple pages decoding (into file#001, file#002... or a multipage TIFF):\n"));
+    printf(_("    minidjvu-mod [options] <multipage DjVu file> <output file>\n"));
     printf(_("Formats supported:\n"));
 
-    printf(_("    DjVu (single-page bitonal), PBM, Windows BMP"));
+    printf(_("    DjVu (bitonal, single-page or bundled), PBM, Windows BMP"));
     if (mdjvu_have_tiff_support())
         printf(_(", TIFF.\n"));
     else
@@ -230,6 +250,8 @@ static void show_usage_and_exit(void)           /* {{{ */
 #ifdef _OPENMP
     printf(_("    -t <n>, --threads-max <n>:     process pages assigned to a different\n"));
     printf(_("                                   dictionaries in up to N parallel threads.\n"));
+    printf(_("                                   A single big page is split in up to\n"));
+    printf(_("                                   N bands concurrently.\n"));
     printf(_("                                   By default N is equal to the number of \n"));
     printf(_("                                   CPU cores in case there're 1 or 2 \n"));
     printf(_("                                   and number of CPU cores minus 1 otherwise\n"));
@@ -330,7 +352,7 @@ static void sort_and_save_image(mdjvu_image_t image, const char *path)
     }
 }
 
-static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
+static mdjvu_bitmap_t load_bitmap(const char *path)
 {
     mdjvu_error_t error = NULL;
     mdjvu_bitmap_t bitmap;
@@ -346,9 +368,9 @@ static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
         if (!options.warnings)
             mdjvu_disable_tiff_warnings();
         if (options.dpi_specified)
-            bitmap = mdjvu_load_tiff(path, NULL, &error, tiff_idx);
+            bitmap = mdjvu_load_tiff(path, NULL, &error, 0);
         else
-            bitmap = mdjvu_load_tiff(path, &options.dpi, &error, tiff_idx);
+            bitmap = mdjvu_load_tiff(path, &options.dpi, &error, 0);
         if (options.verbose) printf(_("resolution is %d dpi\n"), options.dpi);
     }
     else if (decide_if_djvu(path))
@@ -384,6 +406,47 @@ static mdjvu_bitmap_t load_bitmap(const char *path, int tiff_idx)
     return bitmap;
 }
 
+static mdjvu_tiff_reader_t open_tiff_pages(const char *path, int32 first_page)
+{
+    mdjvu_error_t error;
+    mdjvu_tiff_reader_t tiff;
+
+    if (!options.warnings)
+        mdjvu_disable_tiff_warnings();
+    tiff = mdjvu_tiff_reader_open(path, first_page, &error);
+    if (!tiff)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+        exit(1);
+    }
+    return tiff;
+}
+
+static mdjvu_bitmap_t load_tiff_page(mdjvu_tiff_reader_t tiff, const char *path, int32 page)
+{
+    mdjvu_error_t error;
+    mdjvu_bitmap_t bitmap;
+
+    if (options.verbose) printf(_("loading page #%d from TIFF file `%s'\n"), page + 1, path);
+    if (options.dpi_specified)
+        bitmap = mdjvu_tiff_reader_next(tiff, NULL, &error);
+    else
+        bitmap = mdjvu_tiff_reader_next(tiff, &options.dpi, &error);
+    if (!bitmap)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+        exit(1);
+    }
+    if (options.verbose) printf(_("resolution is %d dpi\n"), options.dpi);
+
+    if (options.smooth)
+    {
+        if (options.verbose) printf(_("smoothing the bitmap\n"));
+        mdjvu_smooth(bitmap);
+    }
+    return bitmap;
+}
+
 static void save_bitmap(mdjvu_bitmap_t bitmap, const char *path)
 {
     mdjvu_error_t error;
@@ -416,19 +479,39 @@ static void save_bitmap(mdjvu_bitmap_t bitmap, const char *path)
 
 /* ========================================================================= */
 
-static void decode(int argc, char **argv)
+static void set_thread_count(void)
+{
+#ifdef _OPENMP
+    if (!options.max_threads) {
+        if (omp_get_num_procs() > 2)
+            omp_set_num_threads( omp_get_num_procs() - 1 );
+    } else {
+        omp_set_num_threads( options.max_threads );
+    }
+#endif
+}
+
+static mdjvu_bitmap_t render_page(mdjvu_document_t doc, int32 page, const char *path)
 {
+    mdjvu_error_t error;
     mdjvu_image_t image;    /* a sequence of blits (what is stored in DjVu) */
     mdjvu_bitmap_t bitmap;  /* the result                                   */
 
-    if (options.verbose) {
-        printf(_("\nDECODING\n"));
-        printf(_("________\n\n"));
+    image = mdjvu_document_load_page(doc, page, &error);
+    if (!image)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+        exit(1);
+    }
+    if (options.verbose)
+    {
+        printf(_("page #%d has %d bitmaps and %d blits\n"), page + 1,
+               mdjvu_image_get_bitmap_count(image),
+               mdjvu_image_get_blit_count(image));
     }
 
-    image = load_image(argv[1]);
     bitmap = mdjvu_render(image);
-    mdjvu_image_destroy(image);
+    mdjvu_document_unload_page(doc, image);
 
     if (options.verbose)
     {
@@ -442,11 +525,118 @@ static void decode(int argc, char **argv)
         if (options.verbose) printf(_("smoothing the bitmap\n"));
         mdjvu_smooth(bitmap);
     }
+    return bitmap;
+}
 
-    save_bitmap(bitmap, argv[2]);
-    mdjvu_bitmap_destroy(bitmap);
+/* Pages are rendered in parallel, sharing dictionaries through the document.
+ * A multipage TIFF gets them in order, other formats get a file per page.
+ */
+static void multipage_decode(mdjvu_document_t doc, int32 n, const char *path, const char *outname)
+{
+    mdjvu_error_t error;
+    mdjvu_tiff_writer_t tiff = NULL;
+    int32 i;
+    int32 pages_done = 0; /* pages finish out of order */
+
+    if (decide_if_tiff(outname))
+    {
+        if (!options.warnings)
+            mdjvu_disable_tiff_warnings();
+        tiff = mdjvu_tiff_writer_create(outname, &error);
+        if (!tiff)
+        {
+            fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(error));
+            exit(1);
+        }
+    }
+
+    set_thread_count();
+
+#pragma omp parallel for ordered schedule(dynamic)
+    for (i = 0; i < n; i++)
+    {
+        mdjvu_bitmap_t bitmap = render_page(doc, i, path);
+
+        if (tiff)
+        {
+#pragma omp ordered
+            {
+                mdjvu_error_t page_error;
+                if (options.verbose) printf(_("saving page #%d into %s\n"), i + 1, outname);
+                if (!mdjvu_tiff_writer_append(tiff, bitmap, &page_error))
+                {
+                    fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(page_error));
+                    exit(1);
+                }
+            }
+        }
+        else
+        {
+            char *page_name = get_page_file_name(outname, i + 1);
+            save_bitmap(bitmap, page_name);
+            MDJVU_FREEV(page_name);
+        }
+        mdjvu_bitmap_destroy(bitmap);
+
+        if (options.report)
+        {
+            int32 done;
+#pragma omp atomic capture
+            done = ++pages_done;
+            printf(_("Decoding: %d of %d completed\n"), done, n);
+        }
+    }
+
+    if (tiff)
+        mdjvu_tiff_writer_close(tiff);
 }
 
+static void decode(int argc, char **argv)
+{
+    mdjvu_error_t error;
+    mdjvu_document_t doc;
+    int32 n;
+
+    if (options.verbose) {
+        printf(_("\nDECODING\n"));
+        printf(_("________\n\n"));
+    }
+
+    if (options.verbose) printf(_("loading a DjVu document from `%s'\n"), argv[1]);
+    doc = mdjvu_open_djvu_document(argv[1], &error);
+    if (!doc)
+    {
+        fprintf(stderr, "%s: %s\n", argv[1], mdjvu_get_error_message(error));
+        exit(1);
+    }
+    n = mdjvu_document_get_page_count(doc);
+
+    if (n > 1)
+    {
+        if (options.verbose) printf(_("the document has %d pages\n"), n);
+        multipage_decode(doc, n, argv[1], argv[2]);
+    }
+    else
+    {
+        mdjvu_bitmap_t bitmap = render_page(doc, 0, argv[1]);
+        save_bitmap(bitmap, argv[2]);
+        mdjvu_bitmap_destroy(bitmap);
+    }
+
+    mdjvu_close_djvu_document(doc);
+}
+
+
+static void clean_image(mdjvu_image_t image)
+{
+    if (options.verbose) printf(_("cleaning\n"));
+    mdjvu_clean(image);
+    if (options.verbose)
+    {
+        printf(_("the cleaned image has %d pieces\n"),
+                mdjvu_image_get_blit_count(image));
+    }
+}
 
 static mdjvu_image_t split_and_destroy(mdjvu_bitmap_t bitmap)
 {
@@ -460,22 +650,166 @@ static mdjvu_image_t split_and_destroy(mdjvu_bitmap_t bitmap)
                 mdjvu_image_get_blit_count(image));
     }
     if (options.clean)
+        clean_image(image);
+    return image;
+}
+
+/* Pages with more pixels than this (64 MiB unpacked, a byte per pixel)
+ * are split as they are read, so that the whole bitmap is never in memory.
+ * Smaller ones are loaded first and may be split in parallel bands.
+ */
+#define STREAMING_THRESHOLD (64 * 1024 * 1024)
+
+typedef struct
+{
+    mdjvu_pbm_reader_t pbm;
+    mdjvu_tiff_reader_t tiff;
+    mdjvu_error_t error;
+} RowSource;
+
+static int read_source_row(void *param, unsigned char *row, int32 y)
+{
+    RowSource *source = (RowSource *) param;
+    (void) y; /* rows come in order */
+    if (source->pbm)
+        return mdjvu_pbm_reader_read_row(source->pbm, row, &source->error);
+    else
+        return mdjvu_tiff_reader_read_row(source->tiff, row, &source->error);
+}
+
+static void close_source(RowSource *source)
+{
+    if (source->pbm) mdjvu_pbm_reader_close(source->pbm);
+    if (source->tiff) mdjvu_tiff_reader_close(source->tiff);
+}
+
+/* Loads the rest of a TIFF page from an opened source, row by row. */
+static mdjvu_bitmap_t load_source(RowSource *source, int32 width, int32 height,
+                                  const char *path)
+{
+    mdjvu_bitmap_t bitmap = mdjvu_bitmap_create(width, height);
+    int32 y;
+
+    for (y = 0; y < height; y++)
     {
-        if (options.verbose) printf(_("cleaning\n"));
-        mdjvu_clean(image);
-        if (options.verbose)
+        if (!read_source_row(source, mdjvu_bitmap_access_packed_row(bitmap, y), y))
         {
-            printf(_("the cleaned image has %d pieces\n"),
-                    mdjvu_image_get_blit_count(image));
+            fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(source->error));
+            exit(1);
         }
     }
+    return bitmap;
+}
+
+/* Splits a PBM or TIFF page, parsing its header once: a big page is split
+ * while it's read, a smaller one is loaded whole and split as usual.
+ * Returns NULL for other formats and when smoothing; load_bitmap() does them.
+ */
+static mdjvu_image_t split_while_reading(const char *path)
+{
+    RowSource source = {NULL, NULL, NULL};
+    int32 width = 0, height = 0;
+    mdjvu_image_t image;
+
+    if (options.smooth || decide_if_bmp(path) || decide_if_djvu(path))
+        return NULL;
+
+    if (decide_if_tiff(path))
+    {
+        if (options.verbose) printf(_("loading from TIFF file `%s'\n"), path);
+        source.tiff = open_tiff_pages(path, 0);
+        if (!mdjvu_tiff_reader_next_rows(source.tiff, &width, &height,
+                options.dpi_specified ? NULL : &options.dpi, &source.error))
+        {
+            fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(source.error));
+            exit(1);
+        }
+        if (options.verbose) printf(_("resolution is %d dpi\n"), options.dpi);
+    }
+    else
+    {
+        if (options.verbose) printf(_("loading from PBM file `%s'\n"), path);
+        source.pbm = mdjvu_pbm_reader_open(path, &source.error);
+        if (!source.pbm)
+        {
+            fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(source.error));
+            exit(1);
+        }
+        width = mdjvu_pbm_reader_get_width(source.pbm);
+        height = mdjvu_pbm_reader_get_height(source.pbm);
+    }
+
+    if ((double) width * height <= STREAMING_THRESHOLD)
+    {
+        mdjvu_bitmap_t bitmap;
+        if (source.pbm)
+        {
+            /* the same mapped loading as mdjvu_load_pbm() */
+            bitmap = mdjvu_pbm_reader_load(source.pbm, &source.error);
+            if (!bitmap)
+            {
+                fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(source.error));
+                exit(1);
+            }
+        }
+        else
+            bitmap = load_source(&source, width, height, path);
+        close_source(&source);
+        return split_and_destroy(bitmap);
+    }
+
+    if (options.verbose)
+    {
+        printf(_("splitting %d x %d bitmap from `%s' while reading it\n"),
+               width, height, path);
+    }
+    image = mdjvu_split_rows(width, height, options.dpi, /* options:*/ NULL,
+                             read_source_row, &source);
+    close_source(&source);
+    if (!image)
+    {
+        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(source.error));
+        exit(1);
+    }
+    if (options.verbose)
+    {
+        printf(_("the split image has %d pieces\n"),
+                mdjvu_image_get_blit_count(image));
+    }
+    if (options.clean)
+        clean_image(image);
+    return image;
+}
+
+/* DjVu pages are already split, so their shapes are taken as they are,
+ * unless smoothing needs the whole bitmap.
+ */
+static mdjvu_image_t load_and_split(const char *path)
+{
+    mdjvu_image_t page, image;
+
+    if (!decide_if_djvu(path) || options.smooth)
+    {
+        image = split_while_reading(path);
+        return image ? image : split_and_destroy(load_bitmap(path));
+    }
+
+    page = load_image(path);
+    image = mdjvu_split_image(page, options.dpi, /* options:*/ NULL);
+    mdjvu_image_destroy(page);
+    if (options.verbose)
+    {
+        printf(_("the page has %d pieces after splitting non-symbol data\n"),
+                mdjvu_image_get_blit_count(image));
+    }
+    if (options.clean)
+        clean_image(image);
     return image;
 }
 
 
 static void encode(int argc, char **argv)
 {
-    mdjvu_bitmap_t bitmap;
     mdjvu_image_t image;
 
     if (options.verbose) {
@@ -483,9 +817,8 @@ static void encode(int argc, char **argv)
         printf(_("________\n\n"));
     }
 
-    bitmap = load_bitmap(argv[1], 0);
-
-    image = split_and_destroy(bitmap);
+    set_thread_count();
+    image = load_and_split(argv[1]);
     sort_and_save_image(image, argv[2]);
     mdjvu_image_destroy(image);
 }
@@ -501,7 +834,7 @@ static void filter(int argc, char **argv)
         printf(_("_________\n\n"));
     }
 
-    bitmap = load_bitmap(argv[1], 0);
+    bitmap = load_bitmap(argv[1]);
     save_bitmap(bitmap, argv[2]);
     mdjvu_bitmap_destroy(bitmap);
 }
@@ -522,6 +855,85 @@ static const char *strip_dir(const char *path)
     return strip(strip(path, '\\'), '/');
 }
 
+/* Bundled output goes to a temporary file in the output's directory,
+ * which is renamed when the document is complete. So an error on the way
+ * (exit() removes the temporary file) leaves the old output intact.
+ */
+static char *temporary_output = NULL;
+static FILE *temporary_output_file = NULL;
+
+static void remove_temporary_output(void)
+{
+    if (!temporary_output) return;
+    if (temporary_output_file) fclose(temporary_output_file);
+    remove(temporary_output);
+}
+
+static FILE *open_temporary_output(const char *outname)
+{
+#ifdef _WIN32
+    char dir[MAX_PATH+1];
+    size_t dir_length = strip_dir(outname) - outname;
+    if (dir_length > MAX_PATH) return NULL;
+    if (dir_length)
+    {
+        memcpy(dir, outname, dir_length);
+        dir[dir_length] = 0;
+    }
+    else
+        strcpy(dir, ".");
+    temporary_output = MDJVU_MALLOCV(char, MAX_PATH+1);
+    if (GetTempFileNameA(dir, "djv", 0, temporary_output) != 0)
+    {
+        temporary_output_file = fopen(temporary_output, "w+b");
+        if (!temporary_output_file) remove(temporary_output);
+    }
+#else
+    int i;
+    temporary_output = MDJVU_MALLOCV(char, strlen(outname) + 16);
+    for (i = 0; i < 1000 && !temporary_output_file; i++)
+    {
+        sprintf(temporary_output, "%s.%d.tmp", outname, i);
+        /* "x": never take over an existing file */
+        temporary_output_file = fopen(temporary_output, "w+bx");
+        if (!temporary_output_file && errno != EEXIST) break;
+    }
+#endif
+    if (!temporary_output_file)
+    {
+        MDJVU_FREEV(temporary_output);
+        temporary_output = NULL;
+        return NULL;
+    }
+    atexit(remove_temporary_output);
+    return temporary_output_file;
+}
+
+/* Closes the temporary file and puts it in place of `outname'. */
+static int commit_temporary_output(const char *outname)
+{
+    int ok = !fclose(temporary_output_file);
+    temporary_output_file = NULL;
+#ifdef _WIN32
+    if (ok) remove(outname); /* rename() doesn't replace files here */
+#endif
+    if (!ok || rename(temporary_output, outname))
+        return 0;
+    MDJVU_FREEV(temporary_output);
+    temporary_output = NULL;
+    return 1;
+}
+
+/* clock() would count processor time; without OpenMP only whole seconds */
+static double get_wall_time(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double) time(NULL);
+#endif
+}
+
 
 static void multipage_encode(int n, char **pages, char *outname, uint32 multipage_tiff)
 {
@@ -534,12 +946,8 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
     mdjvu_compression_options_t compr_opts;
     mdjvu_error_t error;
 
-    FILE *f;
-    FILE ** tfs = MDJVU_MALLOCV(FILE *, ndicts);
-#ifdef _WIN32
-    char* tempfilenames = (char*) MDJVU_MALLOCV(char, ndicts*(MAX_PATH+1));
-    memset(tempfilenames, 0, ndicts*(MAX_PATH+1));
-#endif
+    FILE *f = NULL;
+    mdjvu_bundle_writer_t writer = NULL;
 
     options.match = 1;
 
@@ -548,32 +956,21 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
         exit(1);
     }
 
-    if (!options.indirect) {
-#ifdef _WIN32
-        char pathname[MAX_PATH+1];
-        if (GetTempPathA(MAX_PATH+1, pathname) == 0) {
-            fprintf(stderr, _("Could not create a temporary file. (GetTempPathA)\n"));
+    for (int i = 0; i < (multipage_tiff ? 1 : n); i++)
+    {
+        if (!strcmp(pages[i], outname))
+        {
+            fprintf(stderr, _("%s: the output file is also an input file\n"), outname);
             exit(1);
         }
-        char prefix[4] = {'d', 'j', 'v', 0 };
-#endif
+    }
 
-        for (int i = 0; i < ndicts; i++) {
-#ifndef _WIN32
-            tfs[i] = tmpfile();
-#else
-            char* tempfilename = tempfilenames + i*(MAX_PATH+1);
-            if (GetTempFileNameA(pathname, prefix, 0, tempfilename) == 0) {
-                fprintf(stderr, _("Could not create a temporary file. (GetTempFileNameA)\n"));
-                exit(1);
-            }
-            tfs[i] = fopen(tempfilename, "w+b");
-#endif
-            if (!tfs[i])
-            {
-                fprintf(stderr, _("Could not create a temporary file\n"));
-                exit(1);
-            }
+    if (!options.indirect) {
+        f = open_temporary_output(outname);
+        if (!f)
+        {
+            fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(mdjvu_get_error(mdjvu_error_fopen_write)));
+            exit(1);
         }
     }
 
@@ -599,14 +996,7 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
     if (options.pages_per_dict <= 0) options.pages_per_dict = n;
     if (options.pages_per_dict > n) options.pages_per_dict = n;
 
-#ifdef _OPENMP
-    if (!options.max_threads) {
-        if (omp_get_num_procs() > 2)
-            omp_set_num_threads( omp_get_num_procs() - 1 );
-    } else {
-        omp_set_num_threads( options.max_threads );
-    }
-#endif
+    set_thread_count();
 
     // initialize elements with filenames as it can't be done in parallel blocks without critical sections
     int el = 0;
@@ -629,99 +1019,221 @@ static void multipage_encode(int n, char **pages, char *outname, uint32 multipag
         }
     }
 
+    /* Bundled output is streamed: a finished block goes to the file
+     * as soon as all blocks before it are there.
+     */
+    void ***block_buffers = MDJVU_MALLOCV(void **, ndicts);
+    int32 **block_sizes = MDJVU_MALLOCV(int32 *, ndicts);
+    char *block_ready = (char *) calloc(ndicts, 1);
+    int next_block = 0;
+    double writing_time = 0; /* spent in the bundle writer */
+    if (!options.indirect)
+        writer = mdjvu_bundle_writer_create(elements, el_size, (mdjvu_file_t) f);
+
     int block;
     int processed_pages = 0;
+
+    /* Loading is pipelined with compression. The thread that enters
+     * the single region below is the loader: it loads a block's pages
+     * (idle threads help decoding and splitting them), hands the block over
+     * to a compression task and goes on with the next one. Once there are
+     * as many blocks in flight as threads, the loader compresses the block
+     * itself, so loading pauses and memory stays bounded.
+     */
+    int blocks_in_flight = 0;
+    int max_blocks_in_flight = 1;
+#ifdef _OPENMP
+    max_blocks_in_flight = omp_get_max_threads();
+#endif
+
+    /* pages of a multipage TIFF are read in order, so one handle will do */
+    mdjvu_tiff_reader_t tiff = NULL;
+    if (multipage_tiff)
+        tiff = open_tiff_pages(pages[0], 0);
+
 // no need to check _OPENMP as unsupported pragmas are ignored
-#pragma omp parallel for schedule(static, 1) shared(processed_pages)
+#pragma omp parallel
+#pragma omp single
     for (block = 0; block < ndicts; block++) {
         mdjvu_image_t *images = MDJVU_MALLOCV(mdjvu_image_t, options.pages_per_dict);
         int32 pages_compressed = block*options.pages_per_dict;
         int32 pages_to_compress = pages_compressed + options.pages_per_dict > n ? n - pages_compressed : options.pages_per_dict;
-        int el = pages_compressed + block;
-
-        mdjvu_set_report_start_page(compr_opts, pages_compressed + 1);
+        int defer;
 
-
-        mdjvu_bitmap_t bitmap;
-        for (int i = 0; i < pages_to_compress; i++)
+#pragma omp taskgroup
         {
-            if (multipage_tiff)
-                bitmap = load_bitmap(pages[0], pages_compressed + i);
-            else
-                bitmap = load_bitmap(pages[pages_compressed + i], 0);
-            images[i] = split_and_destroy(bitmap);
-            if (options.report)
-                printf(_("Loading: %d of %d completed\n"), pages_compressed + i + 1, n);
+            for (int i = 0; i < pages_to_compress; i++)
+            {
+                mdjvu_bitmap_t bitmap = NULL;
+                if (multipage_tiff)
+                    bitmap = load_tiff_page(tiff, pages[0], pages_compressed + i);
+#pragma omp task firstprivate(i, bitmap)
+                {
+                    if (bitmap)
+                        images[i] = split_and_destroy(bitmap);
+                    else
+                        images[i] = load_and_split(pages[pages_compressed + i]);
+                    if (options.report)
+                        printf(_("Loading: %d of %d completed\n"), pages_compressed + i + 1, n);
+                }
+            }
         }
 
-        mdjvu_image_t dict = mdjvu_compress_multipage(pages_to_compress, images, compr_opts);
+#pragma omp atomic read
+        defer = blocks_in_flight;
+        defer = defer < max_blocks_in_flight;
+#pragma omp atomic
+        blocks_in_flight++;
 
-        const char * dict_name = elements[el];
-        if (!options.indirect)
-            sizes[el] = mdjvu_file_save_djvu_dictionary(dict, (mdjvu_file_t) tfs[block], 0, &error, options.erosion);
-        else
-            sizes[el] = mdjvu_save_djvu_dictionary(dict, dict_name, &error, options.erosion);
-
-        if (!sizes[el])
+#pragma omp task firstprivate(block, images, pages_compressed, pages_to_compress) if(defer)
         {
-            fprintf(stderr, "%s: %s\n", dict_name, mdjvu_get_error_message(error));
-            exit(1);
-        }
+            int el = pages_compressed + block;
 
-        el++;
+            mdjvu_set_report_start_page(compr_opts, pages_compressed + 1);
 
-        for (int i = 0; i < pages_to_compress; i++, el++)
-        {
-            const char * path = elements[el];
+            mdjvu_image_t dict = mdjvu_compress_multipage(pages_to_compress, images, compr_opts);
+
+            const char * dict_name = elements[el];
 
-            if (options.verbose)
-                printf(_("saving page #%d into %s using dictionary %s\n"), pages_compressed + i + 1, path, dict_name);
+            /* buffers[0] is the dictionary, buffers[i + 1] is i-th page */
+            void **buffers = MDJVU_MALLOCV(void *, pages_to_compress + 1);
+            int32 *buffer_sizes = MDJVU_MALLOCV(int32, pages_to_compress + 1);
 
             if (!options.indirect)
-                sizes[el] = mdjvu_file_save_djvu_page(images[i], (mdjvu_file_t) tfs[block], strip_dir(dict_name), 0, &error, options.erosion);
+                mdjvu_memory_save_djvu_dictionary(dict, 0, &buffers[0], &buffer_sizes[0], &error, options.erosion);
             else
-                sizes[el] = mdjvu_save_djvu_page(images[i], path, strip_dir(dict_name), &error, options.erosion);
-            if (!sizes[el])
+                buffer_sizes[0] = mdjvu_save_djvu_dictionary(dict, dict_name, &error, options.erosion);
+
+            if (!buffer_sizes[0])
             {
-                fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(error));
+                fprintf(stderr, "%s: %s\n", dict_name, mdjvu_get_error_message(error));
                 exit(1);
             }
+            sizes[el] = buffer_sizes[0];
+
+            el++;
 
-            mdjvu_image_destroy(images[i]);
-            if (options.report) {
-                printf(_("Saving: %d of %d completed\n"), pages_compressed + i + 1, n);
-                processed_pages++;
-                float res = 100.0*processed_pages/n;
-                printf(_("[%02d."), (int)res); //ensure dot as delimiter as in C locale
-                printf(_("%02d%%]\n"), (int)(100*(res - (int)res)));
+            /* Pages of a block depend only on its dictionary, so they are encoded
+             * concurrently (idle threads pick the tasks up) and then stored
+             * in order.
+             */
+            for (int i = 0; i < pages_to_compress; i++)
+            {
+#pragma omp task firstprivate(i)
+                {
+                    mdjvu_error_t page_error;
+                    const char *path = elements[el + i];
+                    int ok;
+
+                    buffers[i + 1] = NULL;
+                    if (!options.indirect)
+                        ok = mdjvu_memory_save_djvu_page(images[i], strip_dir(dict_name), 0,
+                                                         &buffers[i + 1], &buffer_sizes[i + 1],
+                                                         &page_error, options.erosion);
+                    else
+                        ok = buffer_sizes[i + 1] = mdjvu_save_djvu_page(images[i], path, strip_dir(dict_name),
+                                                                        &page_error, options.erosion);
+                    if (!ok)
+                    {
+                        fprintf(stderr, "%s: %s\n", path, mdjvu_get_error_message(page_error));
+                        exit(1);
+                    }
+                }
             }
-        }
-        mdjvu_image_destroy(dict);
-        //        pages_compressed += pages_to_compress;
-        MDJVU_FREEV(images);
-    } //  #pragma omp parallel
+#pragma omp taskwait
+
+            for (int i = 0; i < pages_to_compress; i++, el++)
+            {
+                const char * path = elements[el];
+
+                if (options.verbose)
+                    printf(_("saving page #%d into %s using dictionary %s\n"), pages_compressed + i + 1, path, dict_name);
+
+                sizes[el] = buffer_sizes[i + 1];
+
+                mdjvu_image_destroy(images[i]);
+                if (options.report) {
+                    printf(_("Saving: %d of %d completed\n"), pages_compressed + i + 1, n);
+                    processed_pages++;
+                    float res = 100.0*processed_pages/n;
+                    printf(_("[%02d."), (int)res); //ensure dot as delimiter as in C locale
+                    printf(_("%02d%%]\n"), (int)(100*(res - (int)res)));
+                }
+            }
+
+            if (!options.indirect)
+            {
+                block_buffers[block] = buffers;
+                block_sizes[block] = buffer_sizes;
+#pragma omp critical(bundle_writer)
+                {
+                    double start = get_wall_time();
+                    block_ready[block] = 1;
+                    while (next_block < ndicts && block_ready[next_block])
+                    {
+                        int32 first_page = next_block * options.pages_per_dict;
+                        int32 count = (first_page + options.pages_per_dict > n ? n - first_page
+                                                                               : options.pages_per_dict) + 1;
+                        for (int i = 0; i < count; i++)
+                        {
+                            if (!mdjvu_bundle_writer_append(writer, block_buffers[next_block][i],
+                                                            block_sizes[next_block][i], &error))
+                            {
+                                fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(error));
+                                exit(1);
+                            }
+                            free(block_buffers[next_block][i]);
+                        }
+                        MDJVU_FREEV(block_buffers[next_block]);
+                        MDJVU_FREEV(block_sizes[next_block]);
+                        next_block++;
+                    }
+                    writing_time += get_wall_time() - start;
+                }
+            }
+            else
+            {
+                MDJVU_FREEV(buffers);
+                MDJVU_FREEV(buffer_sizes);
+            }
+            mdjvu_image_destroy(dict);
+            //        pages_compressed += pages_to_compress;
+            MDJVU_FREEV(images);
+#pragma omp atomic
+            blocks_in_flight--;
+        } //  #pragma omp task
+    } //  #pragma omp single
+
+    if (tiff)
+        mdjvu_tiff_reader_close(tiff);
+
+    MDJVU_FREEV(block_buffers);
+    MDJVU_FREEV(block_sizes);
+    free(block_ready);
 
     if (!options.indirect)
     {
-        f = fopen(outname, "wb");
-        if (!f)
+        double start = get_wall_time();
+        if (!mdjvu_bundle_writer_close(writer, &error))
         {
-            fprintf(stderr, "%s: %s\n", outname, (const char *) mdjvu_get_error(mdjvu_error_fopen_write));
+            fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(error));
             exit(1);
         }
-        mdjvu_files_save_djvu_dir(elements, sizes, el_size, (mdjvu_file_t) f, (mdjvu_file_t*) tfs, ndicts, &error);
-        for (int i = 0; i < ndicts; i++) {
-            fclose(tfs[i]);
-#ifdef _WIN32
-            char* tempfilename = tempfilenames + i*(MAX_PATH+1);
-            remove(tempfilename);
-#endif
+        fflush(f);
+        writing_time += get_wall_time() - start;
+        if (options.verbose)
+        {
+            long bytes = ftell(f);
+            if (writing_time > 0)
+                printf(_("streamed %ld bytes into %s (%.1f MB/s)\n"), bytes, outname, bytes / writing_time / 1e6);
+            else
+                printf(_("streamed %ld bytes into %s\n"), bytes, outname);
+        }
+        if (!commit_temporary_output(outname))
+        {
+            fprintf(stderr, "%s: %s\n", outname, mdjvu_get_error_message(mdjvu_get_error(mdjvu_error_fopen_write)));
+            exit(1);
         }
-        MDJVU_FREEV(tfs);
-#ifdef _WIN32
-        MDJVU_FREEV(tempfilenames);
-#endif
-        fclose(f);
     }
     else
         mdjvu_save_djvu_dir(elements, sizes, el_size, outname, &error);